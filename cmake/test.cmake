@@ -0,0 +1,39 @@
+foreach(test snapshot storage)
+  add_executable(rubus-ecs-${test}-test "")
+
+  set_property(TARGET rubus-ecs-${test}-test PROPERTY CXX_STANDARD 20)
+  set_property(TARGET rubus-ecs-${test}-test PROPERTY MSVC_RUNTIME_LIBRARY MultiThreaded$<$<CONFIG:Debug>:Debug>)
+  use_sanitizer(rubus-ecs-${test}-test)
+
+  target_sources(
+    rubus-ecs-${test}-test
+    PRIVATE
+      test/${test}_test.cpp
+  )
+
+  if (CMAKE_CXX_COMPILER_ID MATCHES "Clang|GNU")
+    target_compile_options(
+      rubus-ecs-${test}-test
+      PRIVATE
+        -Wall
+        -Wextra
+    )
+  endif()
+
+  if (CMAKE_CXX_COMPILER_ID MATCHES "MSVC")
+    target_compile_options(
+      rubus-ecs-${test}-test
+      PRIVATE
+        /W3
+        /sdl
+    )
+  endif()
+
+  target_link_libraries(
+    rubus-ecs-${test}-test
+    PRIVATE
+      rubus-ecs
+  )
+
+  add_test(NAME ${test} COMMAND rubus-ecs-${test}-test)
+endforeach()
@@ -4,7 +4,6 @@
 #include <iostream>
 
 // TODO
-// - component toggle
 // - archetype cache
 // - bulk modification
 #include <rubus-ecs/ecs.hpp>
@@ -1,17 +1,164 @@
 #include "ecs.hpp"
+#include "huge_page_resource.hpp"
+#include "snapshot.hpp"
 
 #include <ranges>
+#include <stdexcept>
+#include <utility>
 
 namespace ruecs {
 
-ComponentArray::ComponentArray(ComponentId id, std::size_t each_size, void (*fn_destructor)(void *))
-    : id{id}, each_size{each_size}, fn_destructor{fn_destructor} {}
+ByteArray::ByteArray(std::pmr::memory_resource *resource) : resource{resource} {}
+
+ByteArray::ByteArray(ByteArray &&other) noexcept
+    : resource{other.resource}, ptr{std::exchange(other.ptr, nullptr)}, length{std::exchange(other.length, 0)},
+      cap{std::exchange(other.cap, 0)}, borrowed{std::exchange(other.borrowed, false)}, owner{std::move(other.owner)} {}
+
+ByteArray::~ByteArray() {
+  if (ptr != nullptr && not borrowed) {
+    resource->deallocate(ptr, cap, alignment);
+  }
+}
+
+auto ByteArray::operator=(ByteArray &&other) noexcept -> ByteArray & {
+  if (this != &other) {
+    if (ptr != nullptr && not borrowed) {
+      resource->deallocate(ptr, cap, alignment);
+    }
+    resource = other.resource;
+    ptr = std::exchange(other.ptr, nullptr);
+    length = std::exchange(other.length, 0);
+    cap = std::exchange(other.cap, 0);
+    borrowed = std::exchange(other.borrowed, false);
+    owner = std::move(other.owner);
+  }
+  return *this;
+}
+
+auto ByteArray::reserve(std::size_t new_cap) -> void {
+  if (new_cap <= cap) {
+    return;
+  }
+
+  // columns that own a slot of reserved address space grow without copying
+  if (auto huge_pages = dynamic_cast<HugePageResource *>(resource);
+      huge_pages != nullptr && ptr != nullptr && not borrowed) {
+    if (huge_pages->try_resize(ptr, new_cap)) {
+      cap = new_cap;
+      return;
+    }
+  }
+
+  auto new_ptr = static_cast<uint8_t *>(resource->allocate(new_cap, alignment));
+  if (ptr != nullptr) {
+    std::memcpy(new_ptr, ptr, length);
+    if (not borrowed) {
+      resource->deallocate(ptr, cap, alignment);
+    }
+  }
+  ptr = new_ptr;
+  cap = new_cap;
+  borrowed = false;
+  owner.reset();
+}
+
+auto ByteArray::resize(std::size_t new_size) -> void {
+  if (new_size > cap) {
+    reserve(std::max(new_size, cap * 2));
+  }
+  length = new_size;
+}
+
+auto ByteArray::clear() noexcept -> void {
+  length = 0;
+  if (borrowed) {
+    ptr = nullptr;
+    cap = 0;
+    borrowed = false;
+    owner.reset();
+  }
+}
+
+auto ByteArray::shrink_to_fit() -> void {
+  if (length == cap || borrowed) {
+    return;
+  }
+
+  if (length == 0) {
+    resource->deallocate(ptr, cap, alignment);
+    ptr = nullptr;
+    cap = 0;
+  } else if (auto huge_pages = dynamic_cast<HugePageResource *>(resource);
+             huge_pages != nullptr && huge_pages->try_resize(ptr, length)) {
+    cap = length;
+  } else {
+    auto new_ptr = static_cast<uint8_t *>(resource->allocate(length, alignment));
+    std::memcpy(new_ptr, ptr, length);
+    resource->deallocate(ptr, cap, alignment);
+    ptr = new_ptr;
+    cap = length;
+  }
+}
+
+auto ByteArray::borrow(uint8_t *data, std::size_t size) -> void {
+  if (ptr != nullptr && not borrowed) {
+    resource->deallocate(ptr, cap, alignment);
+  }
+  ptr = data;
+  length = size;
+  cap = size;
+  borrowed = true;
+  owner.reset();
+}
+
+[[nodiscard]] auto ByteArray::share() -> ByteArray {
+  auto shared = ByteArray{resource};
+  if (length == 0) {
+    return shared;
+  }
+
+  // the mapping is private to this array, so mapped bytes are copied
+  if (borrowed && owner == nullptr) {
+    shared.resize(length);
+    std::memcpy(shared.ptr, ptr, length);
+    return shared;
+  }
+
+  // the last owner frees the bytes
+  if (not borrowed) {
+    owner = std::shared_ptr<void>{ptr, [resource = resource, cap = cap](void *p) {
+                                    resource->deallocate(p, cap, alignment);
+                                  }};
+    borrowed = true;
+  }
+
+  // growing either array copies the bytes first
+  cap = length;
+  shared.ptr = ptr;
+  shared.length = length;
+  shared.cap = length;
+  shared.borrowed = true;
+  shared.owner = owner;
+  return shared;
+}
+
+auto ByteArray::detach() -> void {
+  auto new_ptr = static_cast<uint8_t *>(resource->allocate(cap, alignment));
+  std::memcpy(new_ptr, ptr, length);
+  ptr = new_ptr;
+  borrowed = false;
+  owner.reset();
+}
+
+ComponentArray::ComponentArray(const ComponentInfo &info, std::pmr::memory_resource *resource)
+    : id{info.id}, each_size{info.size}, fn_destructor{info.fn_destructor}, fn_copy{info.fn_copy},
+      copyable{info.copyable}, array{resource}, enabled_bits{resource} {}
 
 [[nodiscard]] auto ComponentArray::get_last() -> std::span<uint8_t> {
   assert(count != 0);
 
   if (each_size == 0) {
-    return array;
+    return {array.data(), array.size()};
   } else {
     return {array.data() + (count - 1) * each_size, each_size};
   }
@@ -21,7 +168,17 @@ ComponentArray::ComponentArray(ComponentId id, std::size_t each_size, void (*fn_
   assert(index.i < count);
 
   if (each_size == 0) {
-    return array;
+    return {array.data(), array.size()};
+  } else {
+    return {array.data() + index.i * each_size, each_size};
+  }
+}
+
+[[nodiscard]] auto ComponentArray::get_at(EntityIndex index) const -> std::span<const uint8_t> {
+  assert(index.i < count);
+
+  if (each_size == 0) {
+    return {array.data(), array.size()};
   } else {
     return {array.data() + index.i * each_size, each_size};
   }
@@ -35,6 +192,159 @@ auto ComponentArray::set_at(EntityIndex index, std::span<uint8_t> value) -> void
   }
 }
 
+auto ComponentArray::reserve(std::size_t n) -> void {
+  array.reserve(n * each_size);
+}
+
+auto ComponentArray::shrink_to_fit() -> void {
+  array.shrink_to_fit();
+}
+
+auto ComponentArray::push_uninitialized() -> void {
+  count += 1;
+  array.resize(array.size() + each_size);
+
+  if (not enabled_bits.empty()) {
+    if (enabled_bits.size() * 64 < count) {
+      enabled_bits.push_back(0);
+    }
+    enabled_bits[(count - 1) / 64] |= uint64_t{1} << ((count - 1) % 64);
+  }
+}
+
+auto ComponentArray::push_uninitialized(std::size_t n) -> void {
+  count += n;
+  array.resize(array.size() + n * each_size);
+
+  // the bits after the last row are always clear, set the ones of the new rows
+  if (not enabled_bits.empty() && n != 0) {
+    const auto begin = count - n;
+    if (begin % 64 != 0) {
+      enabled_bits[begin / 64] |= ~uint64_t{} << (begin % 64);
+    }
+    enabled_bits.resize((count + 63) / 64, ~uint64_t{});
+    clear_bits_after_last();
+  }
+}
+
+auto ComponentArray::push_copies(EntityIndex index, std::size_t n) -> void {
+  assert(index.i < count && copyable);
+
+  const auto begin = count;
+  push_uninitialized(n);
+  if (n == 0 || each_size == 0) {
+    return;
+  }
+
+  const auto dst = array.data() + begin * each_size;
+  if (fn_copy == nullptr) {
+    // copy the row once, then double the copied rows
+    std::memcpy(dst, array.data() + index.i * each_size, each_size);
+    for (auto copied = std::size_t{1}; copied < n;) {
+      const auto k = std::min(copied, n - copied);
+      std::memcpy(dst + copied * each_size, dst, k * each_size);
+      copied += k;
+    }
+  } else {
+    const auto src = array.data() + index.i * each_size;
+    for (auto i = std::size_t{}; i < n; ++i) {
+      fn_copy(dst + i * each_size, src);
+    }
+  }
+
+  if (not is_enabled(index)) {
+    for (auto i = begin; i < begin + n; ++i) {
+      set_enabled({i}, false);
+    }
+  }
+}
+
+auto ComponentArray::copy_from(ComponentArray &other, bool share, const CopyComponentFn &fn_copy_uncopyable)
+  -> void {
+  assert(count == 0 && id == other.id && (copyable || fn_copy_uncopyable || other.count == 0));
+
+  count = other.count;
+  enabled_bits = other.enabled_bits;
+  disabled_count = other.disabled_count;
+
+  if (not copyable) {
+    array.resize(other.array.size());
+    const auto &src = other.array;
+    for (auto i = std::size_t{}; i < count; ++i) {
+      fn_copy_uncopyable(id, array.data() + i * each_size, src.data() + i * each_size);
+    }
+  } else if (fn_copy != nullptr) {
+    array.resize(other.array.size());
+    const auto &src = other.array;
+    for (auto i = std::size_t{}; i < count; ++i) {
+      fn_copy(array.data() + i * each_size, src.data() + i * each_size);
+    }
+  } else if (share) {
+    array = other.array.share();
+  } else if (other.array.size() != 0) {
+    array.resize(other.array.size());
+    std::memcpy(array.data(), other.array.data(), other.array.size());
+  }
+}
+
+auto ComponentArray::append(ComponentArray &other) -> void {
+  assert(id == other.id);
+
+  const auto begin = count;
+  if (count == 0 && array.resource->is_equal(*other.array.resource)) {
+    array = std::move(other.array);
+    count = other.count;
+  } else {
+    // components are moved by memcpy like everywhere else
+    push_uninitialized(other.count);
+    std::memcpy(array.data() + begin * each_size, std::as_const(other.array).data(), other.count * each_size);
+  }
+
+  if (other.disabled_count != 0) {
+    for (auto i = std::size_t{}; i < other.count; ++i) {
+      if (not other.is_enabled({i})) {
+        set_enabled({begin + i}, false);
+      }
+    }
+  }
+
+  other.count = 0;
+  other.array.clear();
+  other.enabled_bits.clear();
+  other.disabled_count = 0;
+}
+
+auto ComponentArray::set_enabled(EntityIndex index, bool enabled) -> void {
+  assert(index.i < count);
+
+  if (is_enabled(index) == enabled) {
+    return;
+  }
+
+  if (enabled_bits.empty()) {
+    enabled_bits.resize((count + 63) / 64, ~uint64_t{});
+    clear_bits_after_last();
+  }
+
+  const auto bit = uint64_t{1} << (index.i % 64);
+  if (enabled) {
+    enabled_bits[index.i / 64] |= bit;
+    disabled_count -= 1;
+    if (disabled_count == 0) {
+      enabled_bits.clear();
+    }
+  } else {
+    enabled_bits[index.i / 64] &= ~bit;
+    disabled_count += 1;
+  }
+}
+
+auto ComponentArray::clear_bits_after_last() -> void {
+  if (count % 64 != 0) {
+    enabled_bits.back() &= ~(~uint64_t{} << (count % 64));
+  }
+}
+
 auto ComponentArray::take_out_at(EntityIndex index) -> void {
   assert(index.i < count);
 
@@ -43,8 +353,22 @@ auto ComponentArray::take_out_at(EntityIndex index) -> void {
       set_at(index, get_last());
     }
   }
+
+  if (not enabled_bits.empty()) {
+    // move the last row's bit into the removed row
+    set_enabled(index, true);
+    set_enabled(index, is_enabled({count - 1}));
+    set_enabled({count - 1}, true);
+  }
+
   count -= 1;
   array.resize(array.size() - each_size);
+
+  // keep one bit per row, the vacated bit is cleared
+  if (not enabled_bits.empty()) {
+    enabled_bits.resize((count + 63) / 64);
+    clear_bits_after_last();
+  }
 }
 
 auto ComponentArray::delete_at(EntityIndex index) -> void {
@@ -57,26 +381,33 @@ auto ComponentArray::delete_at(EntityIndex index) -> void {
 }
 
 auto ComponentArray::delete_all() -> void {
-  for (auto i = std::size_t{}; i < count; ++i) {
-    fn_destructor(array.data() + i * each_size);
+  // only memcpy-able components are shared and they have nothing to destroy
+  if (not array.is_shared()) {
+    for (auto i = std::size_t{}; i < count; ++i) {
+      fn_destructor(array.data() + i * each_size);
+    }
   }
   count = 0;
   array.clear();
+  enabled_bits.clear();
+  disabled_count = 0;
 }
 
 auto ComponentInfo::operator<=>(const ComponentInfo &other) const -> std::strong_ordering {
   return id <=> other.id;
 }
 
-Command::Command(ArchetypeStorage *arch_storage) : arch_storage{arch_storage} {}
+Command::Command(ArchetypeStorage *arch_storage)
+    : arch_storage{arch_storage}, aligned_buf{arch_storage->resource} {}
 
 Command::~Command() {
   discard();
 }
 
 auto Command::create_entity() -> PendingEntity {
-  aligned_buf.emplace_back<CommandType>(CommandType::CreateEntity);
   auto entity = arch_storage->create_entity();
+  aligned_buf.emplace_back<CommandType>(CommandType::CreateEntity);
+  aligned_buf.emplace_back<EntityId>(entity.id); // <-- the entity already exists, the id is only for the log
   return PendingEntity{this, arch_storage, entity.id};
 }
 
@@ -90,10 +421,35 @@ auto Command::delete_entity(PendingEntity entity) -> void {
   aligned_buf.emplace_back<Entity>(Entity{entity.id, entity.arch_storage});
 }
 
-auto Command::run() -> void {
+auto Command::delete_all(const Query &query) -> void {
+  aligned_buf.emplace_back<CommandType>(CommandType::DeleteAll);
+  aligned_buf.emplace_back<std::size_t>(query.includes.size());
+  for (const auto include : query.includes) {
+    aligned_buf.emplace_back<ComponentId>(include);
+  }
+  aligned_buf.emplace_back<std::size_t>(query.excludes.size());
+  for (const auto exclude : query.excludes) {
+    aligned_buf.emplace_back<ComponentId>(exclude);
+  }
+  aligned_buf.emplace_back<std::size_t>(query.sparse_includes.size());
+  for (const auto sparse_set : query.sparse_includes) {
+    aligned_buf.emplace_back<ComponentId>(sparse_set->dense.id);
+  }
+  aligned_buf.emplace_back<std::size_t>(query.sparse_excludes.size());
+  for (const auto sparse_set : query.sparse_excludes) {
+    aligned_buf.emplace_back<ComponentId>(sparse_set->dense.id);
+  }
+}
+
+auto Command::run() -> bool {
+  if (arch_storage->command_log != nullptr && aligned_buf.size() != 0 && not arch_storage->command_log->append(*this)) {
+    return false;
+  }
+
   for (auto i = std::size_t{}; i < aligned_buf.size();) {
     switch (aligned_buf.get<CommandType>(i)) {
     case CommandType::CreateEntity:
+      aligned_buf.get<EntityId>(i);
       break;
     case CommandType::DeleteEntity: {
       auto &entity = aligned_buf.get<Entity>(i);
@@ -103,72 +459,38 @@ auto Command::run() -> void {
         arch_storage->delete_entity(entity);
       }
     } break;
+    case CommandType::DeleteAll: {
+      // match archetypes when the command runs so entities created by earlier commands are included
+      auto query = Query{arch_storage};
+      query.includes.resize(aligned_buf.get<std::size_t>(i));
+      for (auto &include : query.includes) {
+        include = aligned_buf.get<ComponentId>(i);
+      }
+      query.excludes.resize(aligned_buf.get<std::size_t>(i));
+      for (auto &exclude : query.excludes) {
+        exclude = aligned_buf.get<ComponentId>(i);
+      }
+      query.sparse_includes.resize(aligned_buf.get<std::size_t>(i));
+      for (auto &sparse_set : query.sparse_includes) {
+        sparse_set = &arch_storage->sparse_sets.at(aligned_buf.get<ComponentId>(i));
+      }
+      query.sparse_excludes.resize(aligned_buf.get<std::size_t>(i));
+      for (auto &sparse_set : query.sparse_excludes) {
+        sparse_set = &arch_storage->sparse_sets.at(aligned_buf.get<ComponentId>(i));
+      }
+      query.delete_all();
+    } break;
     case CommandType::AddComponent: {
       auto &entity = aligned_buf.get<Entity>(i);
-      auto component_id = ComponentId{aligned_buf.get<std::size_t>(i)};
-      auto fn_destructor = aligned_buf.get<void (*)(void *)>(i);
-      auto component_size = aligned_buf.get<std::size_t>(i);
+      auto &info = aligned_buf.get<ComponentInfo>(i);
       auto component_index = aligned_buf.get<std::size_t>(i);
       auto component_ptr = aligned_buf.get_ptr_at(component_index);
-      i = component_index + component_size;
+      i = component_index + info.size;
 
       // entity must exist
       assert(arch_storage->entity_locations.contains(entity));
 
-      auto &entity_loc = arch_storage->entity_locations.at(entity);
-      auto entity_arch = entity_loc.arch;
-      auto entity_index = entity_loc.index;
-
-      // check if the entity has this component
-      if (not entity_arch->has_component(component_id)) {
-        auto it = std::ranges::find_if(entity_arch->component_ids, [=](ComponentId id) {
-          return id > component_id;
-        });
-        const auto insert_index = static_cast<std::size_t>(it - entity_arch->component_ids.begin());
-
-        // setup component infos
-        auto component_infos = std::vector<ComponentInfo>(entity_arch->components.size() + 1);
-        for (auto i = std::size_t{}, x = std::size_t{}; i < entity_arch->components.size() + 1; ++i) {
-          if (i == insert_index) {
-            x = 1;
-            component_infos[i] = {component_id, component_size, fn_destructor};
-          } else {
-            component_infos[i] = entity_arch->components[i - x].to_component_info();
-          }
-        }
-
-        // get new arch
-        const auto new_arch_id = ArchetypeStorage::calculate_archetype_id(component_infos);
-        arch_storage->archetypes.try_emplace(new_arch_id, new_arch_id, arch_storage, component_infos);
-        arch_storage->component_locations.try_emplace(component_id);
-
-        auto new_arch = &arch_storage->archetypes.at(new_arch_id);
-        auto new_entity_index = new_arch->add_entity(entity);
-
-        for (auto i = std::size_t{}, x = std::size_t{}; i < new_arch->components.size(); ++i) {
-          auto ptr = new_arch->components[i].get_last().data();
-          if (i == insert_index) {
-            x = 1;
-            // construct new component
-            std::memcpy(ptr, component_ptr, component_size);
-            arch_storage->component_locations.at(component_id).try_emplace(new_arch, i);
-          } else {
-            // copy components
-            std::memcpy(ptr, entity_arch->components[i - x].get_at(entity_index).data(),
-                        entity_arch->components[i - x].each_size);
-            arch_storage->component_locations.at(entity_arch->components[i - x].id).try_emplace(new_arch, i);
-          }
-        }
-
-        // take out entity from the old arch
-        entity_arch->take_out_entity(entity_index);
-
-        // update entity location
-        entity_loc.arch = new_arch;
-        entity_loc.index = new_entity_index;
-      } else {
-        fn_destructor(component_ptr);
-      }
+      arch_storage->add_component(entity, info, component_ptr);
     } break;
     case CommandType::RemoveComponent: {
       auto &entity = aligned_buf.get<Entity>(i);
@@ -177,77 +499,44 @@ auto Command::run() -> void {
       // entity must exist
       assert(arch_storage->entity_locations.contains(entity));
 
-      auto &entity_loc = arch_storage->entity_locations.at(entity);
-      auto entity_arch = entity_loc.arch;
-      auto entity_index = entity_loc.index;
-
-      // check if the entity has this component
-      if (entity_arch->has_component(component_id)) {
-        const auto it = std::ranges::find_if(entity_arch->component_ids, [=](ComponentId id) {
-          return id == component_id;
-        });
-        const auto remove_index = static_cast<std::size_t>(it - entity_arch->component_ids.begin());
-
-        // new component infos
-        auto component_infos = std::vector<ComponentInfo>(entity_arch->components.size() - 1);
-        for (auto i = std::size_t{}, x = std::size_t{}; i < component_infos.size(); ++i) {
-          if (i == remove_index) {
-            x = 1;
-          }
-          component_infos[i] = entity_arch->components[i + x].to_component_info();
-        }
-
-        // get new arch
-        const auto new_arch_id = arch_storage->calculate_archetype_id(component_infos);
-        arch_storage->archetypes.try_emplace(new_arch_id, new_arch_id, arch_storage, component_infos);
-
-        auto new_arch = &arch_storage->archetypes.at(new_arch_id);
-        auto new_entity_index = new_arch->add_entity(entity);
-
-        for (auto i = std::size_t{}, x = std::size_t{}; i < entity_arch->components.size(); ++i) {
-          if (i == remove_index) {
-            x = 1;
-            // delete removed component
-            entity_arch->components[i].fn_destructor(entity_arch->components[i].get_at(entity_index).data());
-          } else {
-            // copy components
-            auto ptr = new_arch->components[i - x].get_last().data();
-            std::memcpy(ptr, entity_arch->components[i].get_at(entity_index).data(),
-                        entity_arch->components[i].each_size);
-            arch_storage->component_locations.at(entity_arch->components[i].id).try_emplace(new_arch, i - x);
-          }
-        }
-
-        // take out entity from the old arch
-        entity_arch->take_out_entity(entity_index);
-
-        // update entity location
-        entity_loc.arch = new_arch;
-        entity_loc.index = new_entity_index;
-      }
+      arch_storage->remove_component(entity, component_id);
     } break;
     }
   }
   aligned_buf.clear();
+  return true;
 }
 
 auto Command::discard() -> void {
   for (auto i = std::size_t{}; i < aligned_buf.size();) {
     switch (aligned_buf.get<CommandType>(i)) {
     case CommandType::CreateEntity:
+      aligned_buf.get<EntityId>(i);
       break;
     case CommandType::DeleteEntity: {
       aligned_buf.get<Entity>(i);
     } break;
+    case CommandType::DeleteAll: {
+      for (auto n = aligned_buf.get<std::size_t>(i); n != 0; --n) {
+        aligned_buf.get<ComponentId>(i); // include
+      }
+      for (auto n = aligned_buf.get<std::size_t>(i); n != 0; --n) {
+        aligned_buf.get<ComponentId>(i); // exclude
+      }
+      for (auto n = aligned_buf.get<std::size_t>(i); n != 0; --n) {
+        aligned_buf.get<ComponentId>(i); // sparse include
+      }
+      for (auto n = aligned_buf.get<std::size_t>(i); n != 0; --n) {
+        aligned_buf.get<ComponentId>(i); // sparse exclude
+      }
+    } break;
     case CommandType::AddComponent: {
-      aligned_buf.get<Entity>(i);      // entity
-      aligned_buf.get<std::size_t>(i); // ComponentId
-      auto fn_destructor = aligned_buf.get<void (*)(void *)>(i);
-      auto component_size = aligned_buf.get<std::size_t>(i);
+      aligned_buf.get<Entity>(i); // entity
+      auto &info = aligned_buf.get<ComponentInfo>(i);
       auto component_index = aligned_buf.get<std::size_t>(i);
       auto component_ptr = aligned_buf.get_ptr_at(component_index);
-      i = component_index + component_size;
-      fn_destructor(component_ptr);
+      i = component_index + info.size;
+      info.fn_destructor(component_ptr);
     } break;
     case CommandType::RemoveComponent: {
       aligned_buf.get<Entity>(i);      // entity
@@ -258,36 +547,68 @@ auto Command::discard() -> void {
   aligned_buf.clear();
 }
 
-Archetype::Archetype(ArchetypeId id, ArchetypeStorage *arch_storage) : id{id}, arch_storage{arch_storage} {}
+Archetype::Archetype(ArchetypeId id, ArchetypeStorage *arch_storage)
+    : id{id}, arch_storage{arch_storage}, component_ids{arch_storage->resource}, entities{arch_storage->resource},
+      components{arch_storage->resource}, column_table{arch_storage->resource}, shared_values{arch_storage->resource} {}
 
 Archetype::Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, const ComponentInfo &info)
-    : id{id}, arch_storage{arch_storage} {
-  component_ids.resize(1);
-  component_ids[0] = info.id;
-
-  components.resize(1);
-  components[0].id = info.id;
-  components[0].each_size = info.size;
-  components[0].fn_destructor = info.fn_destructor;
+    : Archetype{id, arch_storage} {
+  component_ids.push_back(info.id);
+  signature_hash = ArchetypeStorage::calculate_signature_hash({&info, 1});
+  column_table.resize(info.id.value + 1, no_column);
+  if (info.has_column()) {
+    column_table[info.id.value] = components.size();
+    components.emplace_back(info, arch_storage->resource);
+  }
 }
 
-Archetype::Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, std::span<ComponentInfo> infos)
-    : id{id}, arch_storage{arch_storage} {
+Archetype::Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, std::span<ComponentInfo> infos,
+                     std::span<const SharedValue> shared_values)
+    : Archetype{id, arch_storage} {
   component_ids.resize(infos.size());
   for (auto i = std::size_t{}; i < infos.size(); ++i) {
     component_ids[i] = infos[i].id;
   }
+  this->shared_values.assign(shared_values.begin(), shared_values.end());
+  signature_hash = ArchetypeStorage::calculate_signature_hash(infos, shared_values);
 
-  components.resize(infos.size());
-  for (auto i = std::size_t{}; i < infos.size(); ++i) {
-    components[i].id = infos[i].id;
-    components[i].each_size = infos[i].size;
-    components[i].fn_destructor = infos[i].fn_destructor;
+  // tags and shared components only go in the signature
+  if (not infos.empty()) {
+    column_table.resize(infos.back().id.value + 1, no_column);
+  }
+  components.reserve(infos.size());
+  for (const auto &info : infos) {
+    if (info.has_column()) {
+      column_table[info.id.value] = components.size();
+      components.emplace_back(info, arch_storage->resource);
+    }
   }
 }
 
 auto Archetype::delete_all_entities() -> void {
-  for (auto entity : entities) {
+  arch_storage->structural_version += 1;
+
+  // one pass per sparse set over the set or the table, whichever is smaller
+  for (auto &[_, sparse_set] : arch_storage->sparse_sets) {
+    if (sparse_set.entities.size() < entities.size()) {
+      auto owned = std::vector<Entity>{};
+      for (const auto entity : sparse_set.entities) {
+        if (auto it = arch_storage->entity_locations.find(entity);
+            it != arch_storage->entity_locations.end() && it->second.arch == this) {
+          owned.push_back(entity);
+        }
+      }
+      for (const auto entity : owned) {
+        sparse_set.erase(entity);
+      }
+    } else {
+      for (const auto entity : entities) {
+        sparse_set.erase(entity);
+      }
+    }
+  }
+
+  for (const auto entity : entities) {
     arch_storage->entity_locations.erase(entity);
   }
   entities.clear();
@@ -297,8 +618,24 @@ auto Archetype::delete_all_entities() -> void {
   }
 }
 
+auto Archetype::reserve(std::size_t n) -> void {
+  entities.reserve(n);
+
+  for (auto &component_array : components) {
+    component_array.reserve(n);
+  }
+}
+
+auto Archetype::shrink_to_fit() -> void {
+  entities.shrink_to_fit();
+
+  for (auto &component_array : components) {
+    component_array.shrink_to_fit();
+  }
+}
+
 [[nodiscard]] auto Archetype::has_component(ComponentId id) -> bool {
-  return std::ranges::find(component_ids, id) != component_ids.end();
+  return std::ranges::binary_search(component_ids, id);
 }
 
 [[nodiscard]] auto Archetype::has_components(std::span<ComponentId> ids) -> bool {
@@ -342,14 +679,57 @@ auto Archetype::delete_all_entities() -> void {
   return true;
 }
 
+[[nodiscard]] auto Archetype::find_column(ComponentId id) -> ComponentArray * {
+  if (id.value >= column_table.size() || column_table[id.value] == no_column) {
+    return nullptr;
+  }
+  return &components[column_table[id.value]];
+}
+
+[[nodiscard]] auto Archetype::component_infos() -> std::vector<ComponentInfo> {
+  auto component_infos = std::vector<ComponentInfo>{};
+  component_infos.reserve(component_ids.size() + 1);
+
+  // the lists are sorted by id, ids without a column are shared components or tags
+  auto column = components.begin();
+  auto shared_value = shared_values.begin();
+  for (const auto component_id : component_ids) {
+    if (column != components.end() && column->id == component_id) {
+      component_infos.push_back(column->to_component_info());
+      ++column;
+    } else if (shared_value != shared_values.end() && shared_value->id == component_id) {
+      component_infos.push_back(arch_storage->shared_value_sets.at(component_id).info);
+      ++shared_value;
+    } else {
+      component_infos.push_back({.id = component_id});
+    }
+  }
+  return component_infos;
+}
+
+[[nodiscard]] auto Archetype::component_infos_with(const ComponentInfo &info) -> std::vector<ComponentInfo> {
+  auto component_infos = this->component_infos();
+
+  const auto it = std::ranges::upper_bound(component_infos, info.id, std::ranges::less(), &ComponentInfo::id);
+  component_infos.insert(it, info);
+  return component_infos;
+}
+
+[[nodiscard]] auto Archetype::component_infos_without(ComponentId id) -> std::vector<ComponentInfo> {
+  auto component_infos = this->component_infos();
+  std::erase_if(component_infos, [=](const ComponentInfo &info) {
+    return info.id == id;
+  });
+  return component_infos;
+}
+
 auto Archetype::add_entity(Entity entity) -> EntityIndex {
-  assert(arch_storage->entity_locations.at(entity).arch != this);
+  assert(not arch_storage->entity_locations.contains(entity) || arch_storage->entity_locations.at(entity).arch != this);
 
   entities.push_back(entity);
 
   for (auto &component_array : components) {
-    component_array.count += 1;
-    component_array.array.resize(component_array.array.size() + component_array.each_size);
+    component_array.push_uninitialized();
   }
 
   return {entities.size() - 1};
@@ -358,6 +738,9 @@ auto Archetype::add_entity(Entity entity) -> EntityIndex {
 auto Archetype::take_out_entity(EntityIndex index) -> void {
   assert(not entities.empty());
 
+  // the last entity is swapped into the row
+  arch_storage->structural_version += 1;
+
   if (index.i < entities.size() - 1) {
     entities[index.i] = entities.back();
     arch_storage->entity_locations.at(entities[index.i]).index = index;
@@ -372,6 +755,9 @@ auto Archetype::take_out_entity(EntityIndex index) -> void {
 auto Archetype::delete_entity(EntityIndex index) -> void {
   assert(not entities.empty());
 
+  // the last entity is swapped into the row
+  arch_storage->structural_version += 1;
+
   if (index.i < entities.size() - 1) {
     entities[index.i] = entities.back();
     arch_storage->entity_locations.at(entities[index.i]).index = index;
@@ -383,36 +769,536 @@ auto Archetype::delete_entity(EntityIndex index) -> void {
   }
 }
 
-ArchetypeStorage::ArchetypeStorage() {
-  archetypes.emplace(0, Archetype{ArchetypeId{0}, this});
+auto Archetype::move_row(EntityIndex index, Archetype *dst, EntityIndex dst_index) -> void {
+  // both component lists are sorted by id
+  auto j = std::size_t{};
+  for (auto &component_array : components) {
+    while (j < dst->components.size() && dst->components[j].id < component_array.id) {
+      ++j;
+    }
+
+    if (j < dst->components.size() && dst->components[j].id == component_array.id) {
+      // copy components
+      dst->components[j].set_at(dst_index, component_array.get_at(index));
+      if (not component_array.is_enabled(index)) {
+        dst->components[j].set_enabled(dst_index, false);
+      }
+    } else {
+      // delete removed component
+      component_array.fn_destructor(component_array.get_at(index).data());
+    }
+  }
+}
+
+SparseSet::SparseSet(const ComponentInfo &info, std::pmr::memory_resource *resource)
+    : dense{info, resource}, entities{resource}, pages{resource} {}
+
+[[nodiscard]] auto SparseSet::find(Entity entity) const -> std::size_t {
+  const auto page = entity.id.value / page_size;
+  if (page >= pages.size() || pages[page].empty()) {
+    return npos;
+  }
+  return pages[page][entity.id.value % page_size];
+}
+
+[[nodiscard]] auto SparseSet::get(Entity entity) -> void * {
+  const auto index = find(entity);
+  if (index == npos) {
+    return nullptr;
+  }
+  return dense.get_at({index}).data();
+}
+
+[[nodiscard]] auto SparseSet::insert(Entity entity) -> void * {
+  assert(not contains(entity));
+
+  link(entity);
+  dense.push_uninitialized();
+  return dense.get_last().data();
+}
+
+auto SparseSet::link(Entity entity) -> void {
+  const auto page = entity.id.value / page_size;
+  if (page >= pages.size()) {
+    pages.resize(page + 1);
+  }
+  if (pages[page].empty()) {
+    pages[page].resize(page_size, npos);
+  }
+  pages[page][entity.id.value % page_size] = entities.size();
+
+  entities.push_back(entity);
+}
+
+auto SparseSet::take_out(Entity entity) -> void {
+  const auto index = find(entity);
+  assert(index != npos);
+
+  if (index < entities.size() - 1) {
+    const auto last = entities.back();
+    entities[index] = last;
+    pages[last.id.value / page_size][last.id.value % page_size] = index;
+  }
+  entities.pop_back();
+  dense.take_out_at({index});
+
+  pages[entity.id.value / page_size][entity.id.value % page_size] = npos;
+}
+
+auto SparseSet::erase(Entity entity) -> void {
+  const auto index = find(entity);
+  if (index != npos) {
+    dense.fn_destructor(dense.get_at({index}).data());
+    take_out(entity);
+  }
+}
+
+auto SparseSet::delete_all() -> void {
+  for (const auto entity : entities) {
+    pages[entity.id.value / page_size][entity.id.value % page_size] = npos;
+  }
+  entities.clear();
+  dense.delete_all();
+}
+
+SharedValueSet::SharedValueSet(const ComponentInfo &info, std::pmr::memory_resource *resource)
+    : info{info}, values(resource), hashed(resource) {}
+
+SharedValueSet::~SharedValueSet() {
+  auto resource = values.get_allocator().resource();
+  for (const auto &[value, _] : values) {
+    info.fn_destructor(value);
+    resource->deallocate(value, info.size, ByteArray::alignment);
+  }
+}
+
+[[nodiscard]] auto SharedValueSet::find(const void *value) const -> const void * {
+  if (info.fn_hash != nullptr) {
+    const auto [begin, end] = hashed.equal_range(info.fn_hash(value));
+    const auto it = std::find_if(begin, end, [&](const auto &stored) {
+      return info.fn_equal(stored.second, value);
+    });
+    return it != end ? it->second : nullptr;
+  }
+
+  const auto it = std::ranges::find_if(values, [&](const auto &stored) {
+    return info.fn_equal(stored.first, value);
+  });
+  return it != values.end() ? it->first : nullptr;
+}
+
+[[nodiscard]] auto SharedValueSet::intern(void *value) -> const void * {
+  if (const auto stored = find(value); stored != nullptr) {
+    info.fn_destructor(value);
+    return stored;
+  }
+
+  auto stored = values.get_allocator().resource()->allocate(info.size, ByteArray::alignment);
+  std::memcpy(stored, value, info.size);
+  insert(stored);
+  return stored;
+}
+
+[[nodiscard]] auto SharedValueSet::intern_copy(const void *value) -> const void * {
+  if (const auto stored = find(value); stored != nullptr) {
+    return stored;
+  }
+
+  auto stored = values.get_allocator().resource()->allocate(info.size, ByteArray::alignment);
+  if (info.fn_copy != nullptr) {
+    info.fn_copy(stored, value);
+  } else {
+    std::memcpy(stored, value, info.size);
+  }
+  insert(stored);
+  return stored;
+}
+
+auto SharedValueSet::insert(void *value) -> void {
+  values.try_emplace(value, 0);
+  if (info.fn_hash != nullptr) {
+    hashed.emplace(info.fn_hash(value), value);
+  }
+}
+
+auto SharedValueSet::retain(const void *value) -> void {
+  values.at(const_cast<void *>(value)) += 1;
+}
+
+auto SharedValueSet::release(const void *value) -> void {
+  auto &count = values.at(const_cast<void *>(value));
+  assert(count != 0);
+  count -= 1;
+}
+
+auto SharedValueSet::erase_unused() -> void {
+  auto resource = values.get_allocator().resource();
+  std::erase_if(values, [&](const auto &stored) {
+    const auto [value, count] = stored;
+    if (count != 0) {
+      return false;
+    }
+
+    if (info.fn_hash != nullptr) {
+      const auto [begin, end] = hashed.equal_range(info.fn_hash(value));
+      hashed.erase(std::find_if(begin, end, [&](const auto &hashed_value) {
+        return hashed_value.second == value;
+      }));
+    }
+    info.fn_destructor(value);
+    resource->deallocate(value, info.size, ByteArray::alignment);
+    return true;
+  });
+}
+
+[[nodiscard]] auto Entity::resolve() const -> ResolvedEntity {
+  auto resolved = ResolvedEntity{};
+  resolved.entity = *this;
+  resolved.resolve();
+  return resolved;
+}
+
+auto ResolvedEntity::resolve() -> void {
+  const auto entity_loc = entity.arch_storage->entity_locations.at(entity);
+  arch = entity_loc.arch;
+  index = entity_loc.index;
+  structural_version = entity.arch_storage->structural_version;
+}
+
+ArchetypeStorage::ArchetypeStorage(std::pmr::memory_resource *resource)
+    : resource{resource}, mapped_snapshots{resource}, archetypes{resource}, free_archetype_ids{resource}, archetype_table{resource},
+      entity_locations{resource}, component_locations{resource}, sparse_sets{resource}, shared_value_sets{resource} {
+  // the empty archetype
+  [[maybe_unused]] auto root = find_or_create_archetype({});
+  assert(root->id == ArchetypeId{0});
 }
 
 ArchetypeStorage::~ArchetypeStorage() {
   delete_all_archetypes();
+
+  auto allocator = std::pmr::polymorphic_allocator<>{resource};
+  for (auto arch : archetypes) {
+    if (arch != nullptr) {
+      allocator.delete_object(arch);
+    }
+  }
 }
 
 auto ArchetypeStorage::delete_all_archetypes() -> void {
-  for (auto &[_, arch] : archetypes) {
-    arch.delete_all_entities();
+  for (auto &[_, sparse_set] : sparse_sets) {
+    sparse_set.delete_all();
+  }
+
+  for (auto arch : archetypes) {
+    if (arch != nullptr) {
+      arch->delete_all_entities();
+    }
+  }
+}
+
+[[nodiscard]] auto ArchetypeStorage::clone(std::pmr::memory_resource *clone_resource, bool share_columns,
+                                           const CopyComponentFn &fn_copy_uncopyable)
+  -> std::unique_ptr<ArchetypeStorage> {
+  // nothing is copied unless every component can be
+  for (const auto arch : archetypes) {
+    if (arch != nullptr && not arch->entities.empty() && not fn_copy_uncopyable &&
+        not std::ranges::all_of(arch->components, &ComponentArray::copyable)) {
+      throw std::logic_error{"clone: a component is not copy constructible"};
+    }
+  }
+  for (const auto &[_, sparse_set] : sparse_sets) {
+    if (not sparse_set.entities.empty() && not fn_copy_uncopyable && not sparse_set.dense.copyable) {
+      throw std::logic_error{"clone: a sparse component is not copy constructible"};
+    }
+  }
+
+  auto world = std::make_unique<ArchetypeStorage>(clone_resource != nullptr ? clone_resource : resource);
+  world->entity_locations.reserve(entity_locations.size());
+
+  // shared bytes are copied on write through the resource they were allocated from
+  share_columns = share_columns && world->resource == resource;
+
+  for (const auto arch : archetypes) {
+    if (arch == nullptr || arch->entities.empty()) {
+      continue;
+    }
+
+    auto component_infos = arch->component_infos();
+    auto shared_values = world->copy_shared_values(*arch);
+    auto new_arch = world->find_or_create_archetype(component_infos, shared_values);
+    new_arch->entities.reserve(arch->entities.size());
+    for (auto entity : arch->entities) {
+      entity.arch_storage = world.get();
+      world->entity_locations.try_emplace(entity, new_arch, EntityIndex{new_arch->entities.size()});
+      new_arch->entities.push_back(entity);
+    }
+
+    // both archetypes have the same columns in the same order
+    for (auto i = std::size_t{}; i < arch->components.size(); ++i) {
+      new_arch->components[i].copy_from(arch->components[i], share_columns, fn_copy_uncopyable);
+    }
+  }
+
+  for (auto &[component_id, sparse_set] : sparse_sets) {
+    auto &new_sparse_set =
+      world->sparse_sets.try_emplace(component_id, sparse_set.dense.to_component_info(), world->resource)
+        .first->second;
+    new_sparse_set.pages = sparse_set.pages;
+    new_sparse_set.entities.reserve(sparse_set.entities.size());
+    for (auto entity : sparse_set.entities) {
+      entity.arch_storage = world.get();
+      new_sparse_set.entities.push_back(entity);
+    }
+    new_sparse_set.dense.copy_from(sparse_set.dense, share_columns, fn_copy_uncopyable);
+  }
+
+  return world;
+}
+
+auto ArchetypeStorage::merge(ArchetypeStorage &&staging, std::unordered_map<EntityId, Entity> *remapped_ids,
+                             bool new_ids) -> void {
+  assert(&staging != this);
+
+  // ids are unique across storages unless both loaded the same snapshot
+  // they are settled before anything moves, in table order so the new ids don't depend on hashing
+  auto remapped = std::unordered_map<EntityId, Entity>{};
+  for (const auto arch : staging.archetypes) {
+    if (arch == nullptr) {
+      continue;
+    }
+    for (const auto entity : arch->entities) {
+      if (new_ids || entity_locations.contains({entity.id, this})) {
+        remapped.try_emplace(entity.id, Entity{{++Entity::id_gen}, this});
+      }
+    }
+  }
+  const auto merged_entity = [&](Entity entity) {
+    if (auto it = remapped.find(entity.id); it != remapped.end()) {
+      return it->second;
+    }
+    return Entity{entity.id, this};
+  };
+
+  entity_locations.reserve(entity_locations.size() + staging.entity_locations.size());
+  for (const auto arch : staging.archetypes) {
+    if (arch == nullptr || arch->entities.empty()) {
+      continue;
+    }
+
+    auto component_infos = arch->component_infos();
+    auto shared_values = copy_shared_values(*arch, &remapped);
+    auto dst = find_or_create_archetype(component_infos, shared_values);
+    dst->entities.reserve(dst->entities.size() + arch->entities.size());
+    for (const auto entity : arch->entities) {
+      const auto moved = merged_entity(entity);
+      entity_locations.try_emplace(moved, dst, EntityIndex{dst->entities.size()});
+      dst->entities.push_back(moved);
+    }
+    arch->entities.clear();
+
+    // both archetypes have the same columns in the same order
+    for (auto i = std::size_t{}; i < arch->components.size(); ++i) {
+      dst->components[i].append(arch->components[i]);
+    }
+  }
+
+  for (auto &[component_id, sparse_set] : staging.sparse_sets) {
+    auto &dst = sparse_sets.try_emplace(component_id, sparse_set.dense.to_component_info(), resource).first->second;
+    for (const auto entity : sparse_set.entities) {
+      sparse_set.pages[entity.id.value / SparseSet::page_size][entity.id.value % SparseSet::page_size] = SparseSet::npos;
+      dst.link(merged_entity(entity));
+    }
+    sparse_set.entities.clear();
+    dst.dense.append(sparse_set.dense);
+  }
+
+  // moved columns can point into the snapshots mapped by `staging`
+  mapped_snapshots.insert(mapped_snapshots.end(), staging.mapped_snapshots.begin(), staging.mapped_snapshots.end());
+
+  staging.entity_locations.clear();
+  staging.structural_version += 1;
+
+  if (remapped_ids != nullptr) {
+    *remapped_ids = std::move(remapped);
   }
 }
 
-auto ArchetypeStorage::calculate_archetype_id(std::span<ComponentInfo> infos) -> ArchetypeId {
-  // TODO: find a better way to hash multiple integers
+auto ArchetypeStorage::compact() -> void {
+  auto allocator = std::pmr::polymorphic_allocator<>{resource};
+  auto erased = false;
+
+  for (auto &arch : archetypes) {
+    if (arch == nullptr) {
+      continue;
+    }
+
+    // the empty archetype is where new entities are created
+    if (arch->id == ArchetypeId{0} || not arch->entities.empty()) {
+      // only shrink columns that are using less than half of their capacity
+      if (arch->entities.size() < arch->entities.capacity() / 2) {
+        arch->shrink_to_fit();
+      }
+      continue;
+    }
+
+    for (const auto component_id : arch->component_ids) {
+      auto component_map = component_locations.find(component_id);
+      component_map->second.erase(arch);
+      if (component_map->second.empty()) {
+        component_locations.erase(component_map);
+      }
+    }
+    for (const auto &shared_value : arch->shared_values) {
+      shared_value_sets.at(shared_value.id).release(shared_value.value);
+    }
+
+    // the id is reused by the next new archetype
+    free_archetype_ids.push_back(arch->id);
+    archetype_count -= 1;
+    allocator.delete_object(arch);
+    arch = nullptr;
+    erased = true;
+  }
+
+  if (erased) {
+    rebuild_archetype_table(archetype_table.size());
+
+    // cached queries hold archetype pointers
+    arch_version += 1;
+  }
+
+  // also frees values that were interned for an archetype that was never created
+  for (auto &[_, shared_value_set] : shared_value_sets) {
+    shared_value_set.erase_unused();
+  }
+
+  entity_locations.rehash(0);
+}
+
+auto ArchetypeStorage::calculate_signature_hash(std::span<const ComponentInfo> infos,
+                                                std::span<const SharedValue> shared_values) -> std::size_t {
   // https://stackoverflow.com/a/72073933
   auto hash = infos.size();
-  for (const auto &info : infos) {
-    auto x = info.id.value;
+  const auto combine = [&](std::size_t x) {
     x = ((x >> 16) ^ x) * 0x45d9f3b;
     x = ((x >> 16) ^ x) * 0x45d9f3b;
     x = (x >> 16) ^ x;
     hash ^= x + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  };
+  for (const auto &info : infos) {
+    combine(info.id.value);
+  }
+
+  // interned values are identified by their address
+  for (const auto &shared_value : shared_values) {
+    combine(reinterpret_cast<std::uintptr_t>(shared_value.value));
+  }
+  return hash;
+}
+
+auto ArchetypeStorage::rebuild_archetype_table(std::size_t table_size) -> void {
+  assert(std::has_single_bit(table_size));
+
+  archetype_table.assign(table_size, 0);
+  const auto mask = table_size - 1;
+  for (const auto arch : archetypes) {
+    if (arch == nullptr) {
+      continue;
+    }
+
+    // linear probing
+    auto slot = arch->signature_hash & mask;
+    while (archetype_table[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    archetype_table[slot] = arch->id.value + 1;
+  }
+}
+
+auto ArchetypeStorage::find_or_create_archetype(std::span<ComponentInfo> infos,
+                                                std::span<const SharedValue> shared_values) -> Archetype * {
+  // keep the table at most half full
+  if ((archetype_count + 1) * 2 > archetype_table.size()) {
+    rebuild_archetype_table(std::max(archetype_table.size() * 2, std::size_t{16}));
+  }
+
+  const auto hash = calculate_signature_hash(infos, shared_values);
+
+  // find arch, the hash only filters and the signature is always compared
+  const auto mask = archetype_table.size() - 1;
+  auto slot = hash & mask;
+  for (; archetype_table[slot] != 0; slot = (slot + 1) & mask) {
+    auto arch = archetypes[archetype_table[slot] - 1];
+    if (arch->signature_hash == hash &&
+        std::ranges::equal(arch->component_ids, infos, std::ranges::equal_to(), {}, &ComponentInfo::id) &&
+        std::ranges::equal(arch->shared_values, shared_values)) {
+      return arch;
+    }
+  }
+
+  // create arch with the next dense id
+  auto arch_id = ArchetypeId{archetypes.size()};
+  if (not free_archetype_ids.empty()) {
+    arch_id = free_archetype_ids.back();
+    free_archetype_ids.pop_back();
+  } else {
+    archetypes.push_back(nullptr);
   }
-  return {hash};
+
+  auto arch = std::pmr::polymorphic_allocator<>{resource}.new_object<Archetype>(arch_id, this, infos, shared_values);
+  archetypes[arch_id.value] = arch;
+  archetype_table[slot] = arch_id.value + 1;
+  archetype_count += 1;
+
+  auto column = std::size_t{};
+  for (const auto &info : infos) {
+    component_locations[info.id].try_emplace(arch, info.has_column() ? column++ : Archetype::no_column);
+  }
+  for (const auto &shared_value : shared_values) {
+    shared_value_sets.at(shared_value.id).retain(shared_value.value);
+  }
+  arch_version += 1;
+
+  return arch;
+}
+
+[[nodiscard]] auto ArchetypeStorage::get_shared_value_set(const ComponentInfo &info) -> SharedValueSet & {
+  assert(info.shared);
+  return shared_value_sets.try_emplace(info.id, info, resource).first->second;
+}
+
+[[nodiscard]] auto ArchetypeStorage::intern_shared_value(const ComponentInfo &info, void *value) -> SharedValue {
+  return {info.id, get_shared_value_set(info).intern(value)};
+}
+
+[[nodiscard]] auto ArchetypeStorage::copy_shared_values(const Archetype &arch,
+                                                        const std::unordered_map<EntityId, Entity> *remapped_ids)
+  -> std::vector<SharedValue> {
+  auto shared_values = std::vector<SharedValue>{};
+  shared_values.reserve(arch.shared_values.size());
+  auto value = ByteArray{};
+  for (const auto &shared_value : arch.shared_values) {
+    const auto &info = arch.arch_storage->shared_value_sets.at(shared_value.id).info;
+    auto &shared_value_set = get_shared_value_set(info);
+
+    // pairs are trivially copyable, a pair whose target got a new id is interned with the new target
+    if (info.fn_target != nullptr && remapped_ids != nullptr) {
+      value.resize(info.size);
+      std::memcpy(value.data(), shared_value.value, info.size);
+      const auto target = info.fn_target(value.data());
+      if (const auto it = remapped_ids->find(*target); it != remapped_ids->end()) {
+        *target = it->second.id;
+        shared_values.push_back({shared_value.id, shared_value_set.intern(value.data())});
+        continue;
+      }
+    }
+    shared_values.push_back({shared_value.id, shared_value_set.intern_copy(shared_value.value)});
+  }
+  return shared_values;
 }
 
 [[nodiscard]] auto ArchetypeStorage::create_entity() -> Entity {
-  auto arch = &archetypes.at({0});
+  auto arch = archetypes[0];
   auto entity = Entity{
     .id = {++Entity::id_gen},
     .arch_storage = this,
@@ -422,25 +1308,232 @@ auto ArchetypeStorage::calculate_archetype_id(std::span<ComponentInfo> infos) ->
   return entity;
 }
 
+[[nodiscard]] auto ArchetypeStorage::instantiate(Entity prefab, std::size_t n) -> std::vector<Entity> {
+  const auto prefab_loc = entity_locations.at(prefab);
+  auto arch = prefab_loc.arch;
+
+  // nothing is created unless every component of the prefab can be copied
+  if (not std::ranges::all_of(arch->components, &ComponentArray::copyable)) {
+    throw std::logic_error{"instantiate: a component of the prefab is not copy constructible"};
+  }
+  for (const auto &[_, sparse_set] : sparse_sets) {
+    if (not sparse_set.dense.copyable && sparse_set.contains(prefab)) {
+      throw std::logic_error{"instantiate: a sparse component of the prefab is not copy constructible"};
+    }
+  }
+
+  auto instances = std::vector<Entity>{};
+  instances.reserve(n);
+  arch->entities.reserve(arch->entities.size() + n);
+  entity_locations.reserve(entity_locations.size() + n);
+  for (auto i = std::size_t{}; i < n; ++i) {
+    const auto entity = Entity{
+      .id = {++Entity::id_gen},
+      .arch_storage = this,
+    };
+    entity_locations.try_emplace(entity, arch, EntityIndex{arch->entities.size()});
+    arch->entities.push_back(entity);
+    instances.push_back(entity);
+  }
+
+  for (auto &component_array : arch->components) {
+    component_array.push_copies(prefab_loc.index, n);
+  }
+
+  for (auto &[_, sparse_set] : sparse_sets) {
+    if (const auto index = sparse_set.find(prefab); index != SparseSet::npos) {
+      for (const auto entity : instances) {
+        sparse_set.link(entity);
+      }
+      sparse_set.dense.push_copies({index}, n);
+    }
+  }
+
+  return instances;
+}
+
 auto ArchetypeStorage::delete_entity(Entity entity) -> void {
   auto entity_loc = entity_locations.at(entity);
   auto entity_arch = entity_loc.arch;
   auto entity_index = entity_loc.index;
   entity_arch->delete_entity(entity_index);
   entity_locations.erase(entity);
+  delete_sparse_components(entity);
+}
+
+auto ArchetypeStorage::add_component(Entity entity, const ComponentInfo &info, void *component) -> void {
+  if (auto it = sparse_sets.find(info.id); it != sparse_sets.end()) {
+    auto &sparse_set = it->second;
+    if (not sparse_set.contains(entity)) {
+      auto ptr = sparse_set.insert(entity);
+      if (info.size != 0) {
+        std::memcpy(ptr, component, info.size);
+      }
+    } else {
+      info.fn_destructor(component);
+    }
+    return;
+  }
+
+  auto &entity_loc = entity_locations.at(entity);
+
+  if (info.shared) {
+    // the value picks the archetype, an equal value leaves the entity where it is
+    const auto &arch_shared_values = entity_loc.arch->shared_values;
+    auto shared_values = std::vector<SharedValue>(arch_shared_values.begin(), arch_shared_values.end());
+    const auto shared_value = intern_shared_value(info, component);
+    const auto it = std::ranges::lower_bound(shared_values, info.id, std::ranges::less(), &SharedValue::id);
+    if (it != shared_values.end() && it->id == info.id) {
+      if (*it == shared_value) {
+        return;
+      }
+      *it = shared_value;
+    } else {
+      shared_values.insert(it, shared_value);
+    }
+
+    auto component_infos = entity_loc.arch->has_component(info.id) ? entity_loc.arch->component_infos()
+                                                                    : entity_loc.arch->component_infos_with(info);
+    auto new_arch = find_or_create_archetype(component_infos, shared_values);
+    move_entity(entity_loc, new_arch, new_arch->add_entity(entity));
+    return;
+  }
+
+  // check if the entity has this component
+  if (entity_loc.arch->has_component(info.id)) {
+    info.fn_destructor(component);
+    return;
+  }
+
+  // get new arch
+  auto component_infos = entity_loc.arch->component_infos_with(info);
+  auto new_arch = find_or_create_archetype(component_infos, entity_loc.arch->shared_values);
+  auto new_entity_index = new_arch->add_entity(entity);
+
+  // move new component
+  if (info.size != 0) {
+    std::memcpy(new_arch->find_column(info.id)->get_last().data(), component, info.size);
+  }
+
+  move_entity(entity_loc, new_arch, new_entity_index);
+}
+
+auto ArchetypeStorage::remove_component(Entity entity, ComponentId component_id) -> void {
+  if (auto it = sparse_sets.find(component_id); it != sparse_sets.end()) {
+    it->second.erase(entity);
+    return;
+  }
+
+  auto &entity_loc = entity_locations.at(entity);
+
+  // check if the entity has this component
+  if (not entity_loc.arch->has_component(component_id)) {
+    return;
+  }
+
+  // get new arch
+  auto component_infos = entity_loc.arch->component_infos_without(component_id);
+  const auto &arch_shared_values = entity_loc.arch->shared_values;
+  auto shared_values = std::vector<SharedValue>(arch_shared_values.begin(), arch_shared_values.end());
+  std::erase_if(shared_values, [=](const SharedValue &shared_value) {
+    return shared_value.id == component_id;
+  });
+  auto new_arch = find_or_create_archetype(component_infos, shared_values);
+  auto new_entity_index = new_arch->add_entity(entity);
+
+  move_entity(entity_loc, new_arch, new_entity_index);
+}
+
+auto ArchetypeStorage::move_entity(EntityLocation &entity_loc, Archetype *new_arch, EntityIndex new_entity_index)
+  -> void {
+  auto entity_arch = entity_loc.arch;
+  auto entity_index = entity_loc.index;
+
+  entity_arch->move_row(entity_index, new_arch, new_entity_index);
+
+  // take out entity from the old arch
+  entity_arch->take_out_entity(entity_index);
+
+  // update entity location
+  entity_loc.arch = new_arch;
+  entity_loc.index = new_entity_index;
+}
+
+auto ArchetypeStorage::delete_sparse_components(Entity entity) -> void {
+  for (auto &[_, sparse_set] : sparse_sets) {
+    sparse_set.erase(entity);
+  }
+}
+
+[[nodiscard]] auto ArchetypeStorage::sorted_locations(std::span<const Entity> entities)
+  -> std::pmr::vector<std::pair<EntityLocation, std::size_t>> {
+  auto locations = std::pmr::vector<std::pair<EntityLocation, std::size_t>>{resource};
+  locations.reserve(entities.size());
+  for (auto i = std::size_t{}; i < entities.size(); ++i) {
+    locations.emplace_back(entity_locations.at(entities[i]), i);
+  }
+
+  // group by archetype and walk each column forward, archetype ids keep the order the same between runs
+  std::ranges::sort(locations, std::ranges::less(), [](const auto &location) {
+    return std::pair{location.first.arch->id.value, location.first.index.i};
+  });
+  return locations;
+}
+
+[[nodiscard]] auto ArchetypeStorage::find_component_array(Entity entity, ComponentId component_id)
+  -> std::pair<ComponentArray *, EntityIndex> {
+  if (auto it = sparse_sets.find(component_id); it != sparse_sets.end()) {
+    auto &sparse_set = it->second;
+    return {&sparse_set.dense, {sparse_set.find(entity)}};
+  }
+
+  auto entity_loc = entity_locations.at(entity);
+  return {entity_loc.arch->find_column(component_id), entity_loc.index};
 }
 
-Query::Query(ArchetypeStorage *arch_storage) : arch_storage{arch_storage} {}
+auto ArchetypeStorage::set_enabled(Entity entity, ComponentId component_id, bool enabled) -> void {
+  auto [component_array, index] = find_component_array(entity, component_id);
+  assert(component_array != nullptr && index.i != SparseSet::npos);
+  component_array->set_enabled(index, enabled);
+}
+
+[[nodiscard]] auto ArchetypeStorage::is_enabled(Entity entity, ComponentId component_id) -> bool {
+  auto [component_array, index] = find_component_array(entity, component_id);
+  assert(component_array != nullptr && index.i != SparseSet::npos);
+  return component_array->is_enabled(index);
+}
+
+Query::Query(ArchetypeStorage *arch_storage) : arch_storage{arch_storage}, archs{arch_storage->resource} {}
+
+Query::Query(const Query &other)
+    : arch_storage{other.arch_storage}, arch_version{other.arch_version}, includes{other.includes},
+      excludes{other.excludes}, sparse_includes{other.sparse_includes}, sparse_excludes{other.sparse_excludes},
+      archs{other.archs, arch_storage->resource}, archs_it{archs.begin()}, index{other.index} {}
+
+auto Query::operator=(const Query &other) -> Query & {
+  if (this != &other) {
+    arch_storage = other.arch_storage;
+    arch_version = other.arch_version;
+    includes = other.includes;
+    excludes = other.excludes;
+    sparse_includes = other.sparse_includes;
+    sparse_excludes = other.sparse_excludes;
+    archs = ComponentMap{other.archs, arch_storage->resource};
+    archs_it = archs.begin();
+    index = other.index;
+  }
+  return *this;
+}
 
 auto Query::update_archs() -> void {
-  arch_count = arch_storage->archetypes.size();
+  arch_version = arch_storage->arch_version;
   archs.clear();
   auto &component_locations = arch_storage->component_locations;
 
   // includes
   if (includes.empty()) {
     for (const auto &[_, component_map] : component_locations) {
-      for (const auto arch : component_map) {
+      for (const auto &arch : component_map) {
         archs.insert(arch);
       }
     }
@@ -475,22 +1568,94 @@ auto Query::update_archs() -> void {
 }
 
 auto Query::start() -> void {
-  if (arch_count != arch_storage->archetypes.size()) {
+  if (arch_version != arch_storage->arch_version) {
     update_archs();
   }
   archs_it = archs.begin();
   index = 0;
+  update_include_columns();
+
+  // without archetype components the smallest sparse set is iterated
+  if (includes.empty() && not sparse_includes.empty()) {
+    const auto smallest = std::ranges::min_element(sparse_includes, std::ranges::less(), [](SparseSet *sparse_set) {
+      return sparse_set->entities.size();
+    });
+    std::ranges::iter_swap(sparse_includes.begin(), smallest);
+  }
+}
+
+auto Query::update_include_columns() -> void {
+  include_columns.clear();
+  if (archs_it != archs.end()) {
+    for (const auto include : includes) {
+      // tags have no column and can't be disabled
+      if (auto column = archs_it->first->find_column(include); column != nullptr) {
+        include_columns.push_back(column);
+      }
+    }
+  }
+}
+
+[[nodiscard]] auto Query::next_enabled_index(std::size_t count) const -> std::size_t {
+  // scan the enabled bits of the included columns a word at a time
+  for (auto i = index; i < count; i = (i / 64 + 1) * 64) {
+    const auto word = i / 64;
+    auto bits = ~uint64_t{} << (i % 64);
+    for (const auto column : include_columns) {
+      if (column->disabled_count != 0) {
+        bits &= column->enabled_word(word);
+      }
+    }
+    if (bits != 0) {
+      return std::min(word * 64 + static_cast<std::size_t>(std::countr_zero(bits)), count);
+    }
+  }
+  return count;
+}
+
+[[nodiscard]] auto Query::matches_sparse(Entity entity) const -> bool {
+  return std::ranges::all_of(sparse_includes,
+                             [=](SparseSet *sparse_set) {
+                               const auto index = sparse_set->find(entity);
+                               return index != SparseSet::npos && sparse_set->dense.is_enabled({index});
+                             }) &&
+         std::ranges::none_of(sparse_excludes, [=](SparseSet *sparse_set) {
+           return sparse_set->contains(entity);
+         });
 }
 
 auto Query::get_next_entity(Command *command) -> ReadOnlyEntity {
+  if (includes.empty() && not sparse_includes.empty()) {
+    return get_next_sparse_entity(command);
+  }
+
   while (archs_it != archs.end()) {
     auto arch = (*archs_it).first;
+    index = next_enabled_index(arch->entities.size());
     if (index == arch->entities.size()) {
       archs_it = std::next(archs_it);
       index = 0;
+      update_include_columns();
     } else {
       auto entity = arch->entities[index];
-      return {command, arch_storage, arch, {index++}, entity.id};
+      auto entity_index = EntityIndex{index++};
+      if (matches_sparse(entity)) {
+        return {command, arch_storage, arch, entity_index, entity.id};
+      }
+    }
+  }
+
+  index = 0;
+  return {};
+}
+
+auto Query::get_next_sparse_entity(Command *command) -> ReadOnlyEntity {
+  auto sparse_set = sparse_includes.front();
+  while (index < sparse_set->entities.size()) {
+    auto entity = sparse_set->entities[index++];
+    auto entity_loc = arch_storage->entity_locations.at(entity);
+    if (entity_loc.arch->not_has_components(excludes) && matches_sparse(entity)) {
+      return {command, arch_storage, entity_loc.arch, entity_loc.index, entity.id};
     }
   }
 
@@ -498,4 +1663,41 @@ auto Query::get_next_entity(Command *command) -> ReadOnlyEntity {
   return {};
 }
 
+auto Query::delete_all() -> void {
+  if (arch_version != arch_storage->arch_version) {
+    update_archs();
+  }
+
+  // sparse components and disabled rows can match only part of a table
+  auto has_partial_archs = not sparse_includes.empty() || not sparse_excludes.empty();
+  for (const auto &[arch, _] : archs) {
+    const auto fully_enabled = std::ranges::all_of(includes, [=](ComponentId include) {
+      auto column = arch->find_column(include);
+      return column == nullptr || column->disabled_count == 0;
+    });
+
+    if (not has_partial_archs && fully_enabled) {
+      // drop whole tables instead of deleting entities one by one
+      arch->delete_all_entities();
+    } else {
+      has_partial_archs = true;
+    }
+  }
+
+  if (has_partial_archs) {
+    auto entities = std::vector<Entity>{};
+    start();
+    for (auto entity = get_next_entity(nullptr); entity.arch != nullptr; entity = get_next_entity(nullptr)) {
+      entities.push_back({entity.id, arch_storage});
+    }
+    for (const auto entity : entities) {
+      arch_storage->delete_entity(entity);
+    }
+  }
+}
+
+auto Query::delete_all(Command *command) -> void {
+  command->delete_all(*this);
+}
+
 } // namespace ruecs
@@ -1,12 +1,23 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <cassert>
+#include <concepts>
+#include <filesystem>
 #include <functional>
+#include <iosfwd>
+#include <memory>
+#include <memory_resource>
 #include <span>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <bit>
 
 namespace ruecs {
 
@@ -36,6 +47,13 @@ struct ArchetypeId {
 
 } // namespace ruecs
 
+template <>
+struct std::hash<ruecs::EntityId> {
+  inline auto operator()(const ruecs::EntityId &id) const -> std::size_t {
+    return id.value;
+  }
+};
+
 template <>
 struct std::hash<ruecs::ComponentId> {
   inline auto operator()(const ruecs::ComponentId &id) const -> std::size_t {
@@ -53,9 +71,12 @@ struct std::hash<ruecs::ArchetypeId> {
 namespace ruecs {
 
 struct ArchetypeStorage;
+struct ResolvedEntity;
+struct Snapshot;
+struct CommandLog;
 
 struct Entity {
-  static inline std::size_t id_gen = 0;
+  static inline auto id_gen = std::atomic<std::size_t>{0}; // <-- snapshots read it from other threads
   EntityId id;
   ArchetypeStorage *arch_storage = nullptr;
 
@@ -64,11 +85,33 @@ struct Entity {
   template <typename T>
   [[nodiscard]] auto get_component() -> T *;
 
+  // returns nullptr if the entity doesn't have the shared component
+  template <typename T>
+  [[nodiscard]] auto get_shared() -> const T *;
+
+  // looks up the entity once for every component
+  template <typename... Ts>
+  [[nodiscard]] auto get() -> std::tuple<Ts *...>;
+
+  // returns nullptr if the entity doesn't exist or doesn't have the component
+  template <typename T>
+  [[nodiscard]] auto try_get() -> T *;
+
   template <typename T, typename... Args>
   auto add_component(Args &&...args) -> void;
 
   template <typename T>
   auto remove_component() -> void;
+
+  // disabled components stay in place but queries including them skip the entity, tags can't be disabled
+  template <typename T>
+  auto set_enabled(bool enabled) -> void;
+
+  template <typename T>
+  [[nodiscard]] auto is_enabled() -> bool;
+
+  // caches the entity location for repeated component access
+  [[nodiscard]] auto resolve() const -> ResolvedEntity;
 };
 
 } // namespace ruecs
@@ -86,8 +129,216 @@ struct ComponentInfo {
   ComponentId id;
   std::size_t size = 0;
   void (*fn_destructor)(void *component) = nullptr;
+  void (*fn_copy)(void *dst, const void *src) = nullptr; // <-- nullptr if the component can be copied with memcpy
+  bool (*fn_equal)(const void *a, const void *b) = nullptr; // <-- set for shared components
+  std::size_t (*fn_hash)(const void *component) = nullptr;  // <-- set for shared components with a std::hash
+  EntityId *(*fn_target)(void *component) = nullptr;       // <-- set for pairs, merges remap the target through it
+  bool shared = false;
+  bool copyable = true; // <-- false for components without a copy constructor, they can't be cloned or instantiated
 
   auto operator<=>(const ComponentInfo &other) const -> std::strong_ordering;
+
+  // tags and shared components have no column
+  [[nodiscard]] inline auto has_column() const noexcept -> bool {
+    return size != 0 && not shared;
+  }
+};
+
+// copies a component of type `id` into `dst`, which holds no component yet
+using CopyComponentFn = std::function<void(ComponentId id, void *dst, const void *src)>;
+
+// Components declaring `static constexpr auto sparse_storage = true;` are stored in a sparse set
+// instead of an archetype column, so adding or removing them never moves the entity.
+template <typename T>
+concept SparseComponent = requires { requires T::sparse_storage; };
+
+// Components declaring `static constexpr auto shared_storage = true;` have one value per archetype instead of
+// one per row. The value is part of the archetype signature, so entities with equal values share a table and
+// large values that repeat across many entities, like a mesh and its material, cost nothing per row.
+// They are read with `get_shared` and adding one with another value moves the entity to another archetype.
+template <typename T>
+concept SharedComponent = requires { requires T::shared_storage; };
+
+// Empty components are tags.
+// They are part of the archetype signature but have no column, so they cost nothing per row.
+template <typename T>
+concept TagComponent = std::is_empty_v<T> && std::is_trivially_destructible_v<T>;
+
+// Relationship pair of a relation `R` and a target entity, like `ChildOf` or `Pair<struct Targets>`.
+// Pairs are shared components, so the entities with the same target share a table and the target is looked up
+// once per table instead of once per entity. Targets are ids, entities that get new ids in `ArchetypeStorage::merge`
+// or `ArchetypeStorage::load_partition` keep pointing at each other.
+template <typename R>
+struct Pair {
+  static constexpr auto shared_storage = true;
+  EntityId target;
+
+  auto operator==(const Pair &other) const -> bool = default;
+};
+
+template <typename T>
+inline constexpr auto is_pair = false;
+
+template <typename R>
+inline constexpr auto is_pair<Pair<R>> = true;
+
+struct ChildOfRelation {};
+
+// parent of an entity, `Hierarchy` visits the entities in breadth-first order along it
+using ChildOf = Pair<ChildOfRelation>;
+
+} // namespace ruecs
+
+template <typename R>
+struct std::hash<ruecs::Pair<R>> {
+  inline auto operator()(const ruecs::Pair<R> &pair) const -> std::size_t {
+    return pair.target.value;
+  }
+};
+
+namespace ruecs {
+
+// tags have no data, every `get_component` of a tag returns this instance
+template <TagComponent T>
+inline auto tag_instance = T{};
+
+inline auto component_id_gen = std::atomic<std::size_t>{0};
+
+// Component ids are dense, so they can index tables directly.
+// They are assigned on first use and are not stable between runs.
+// `const T` and `T &` have the id of `T`.
+template <typename T>
+[[nodiscard]] auto component_id() -> ComponentId {
+  if constexpr (not std::is_same_v<T, std::remove_cvref_t<T>>) {
+    return component_id<std::remove_cvref_t<T>>();
+  } else {
+    static const auto id = ComponentId{component_id_gen++};
+    return id;
+  }
+}
+
+template <typename T>
+[[nodiscard]] auto component_info() -> ComponentInfo {
+  auto info = ComponentInfo{
+    .id = component_id<T>(),
+    .size = TagComponent<T> ? 0 : sizeof(T),
+    .fn_destructor =
+      [](void *component) {
+        std::destroy_at(static_cast<T *>(component));
+      },
+  };
+
+  // copies are only made by `ArchetypeStorage::clone` and `ArchetypeStorage::instantiate`
+  if constexpr (std::is_copy_constructible_v<T> && not std::is_trivially_copyable_v<T>) {
+    info.fn_copy = [](void *dst, const void *src) {
+      std::construct_at(static_cast<T *>(dst), *static_cast<const T *>(src));
+    };
+  } else if constexpr (not std::is_trivially_copyable_v<T>) {
+    info.copyable = false;
+  }
+
+  if constexpr (SharedComponent<T>) {
+    static_assert(not SparseComponent<T> && not TagComponent<T>, "shared components are stored per archetype");
+    static_assert(std::is_copy_constructible_v<T>, "shared values are copied into every storage that uses them");
+    static_assert(std::equality_comparable<T>, "shared values are interned by comparing them");
+    info.shared = true;
+    info.fn_equal = [](const void *a, const void *b) {
+      return *static_cast<const T *>(a) == *static_cast<const T *>(b);
+    };
+    if constexpr (requires(const T &component) { std::hash<T>{}(component); }) {
+      info.fn_hash = [](const void *component) {
+        return std::hash<T>{}(*static_cast<const T *>(component));
+      };
+    }
+    if constexpr (is_pair<T>) {
+      info.fn_target = [](void *component) {
+        return &static_cast<T *>(component)->target;
+      };
+    }
+  }
+  return info;
+}
+
+// Growable byte storage for component columns.
+// Unlike std::vector<uint8_t>, growing it does not zero-fill the new bytes.
+struct ByteArray {
+  static constexpr auto alignment = std::size_t{64};
+
+  std::pmr::memory_resource *resource = std::pmr::get_default_resource();
+  uint8_t *ptr = nullptr;
+  std::size_t length = 0;
+  std::size_t cap = 0;
+  bool borrowed = false;       // <-- `ptr` is memory the array doesn't own, like a mapped snapshot
+  std::shared_ptr<void> owner; // <-- set while `ptr` is shared with clones, writers copy it first
+
+  ByteArray() = default;
+  explicit ByteArray(std::pmr::memory_resource *resource);
+  ByteArray(const ByteArray &other) = delete;
+  ByteArray(ByteArray &&other) noexcept;
+  ~ByteArray();
+
+  auto operator=(const ByteArray &other) -> ByteArray & = delete;
+  auto operator=(ByteArray &&other) noexcept -> ByteArray &;
+
+  // mutable access copies shared bytes so the other owners don't see the writes
+  [[nodiscard]] inline auto data() -> uint8_t * {
+    if (is_shared()) {
+      detach();
+    }
+    return ptr;
+  }
+
+  [[nodiscard]] inline auto data() const noexcept -> const uint8_t * {
+    return ptr;
+  }
+
+  [[nodiscard]] inline auto is_shared() const noexcept -> bool {
+    if (owner == nullptr) {
+      return false;
+    }
+    if (owner.use_count() > 1) {
+      return true;
+    }
+
+    // a clone on another thread may have just let go, its reads happen before our writes
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return false;
+  }
+
+  [[nodiscard]] inline auto size() const noexcept -> std::size_t {
+    return length;
+  }
+
+  [[nodiscard]] inline auto capacity() const noexcept -> std::size_t {
+    return cap;
+  }
+
+  [[nodiscard]] inline auto empty() const noexcept -> bool {
+    return length == 0;
+  }
+
+  [[nodiscard]] inline auto operator[](std::size_t index) -> uint8_t & {
+    return data()[index];
+  }
+
+  [[nodiscard]] inline auto operator[](std::size_t index) const noexcept -> const uint8_t & {
+    return ptr[index];
+  }
+
+  auto reserve(std::size_t new_cap) -> void; // <-- borrowed bytes are copied to owned memory
+  auto resize(std::size_t new_size) -> void; // <-- new bytes are left uninitialized
+  auto clear() noexcept -> void;             // <-- also lets go of borrowed memory
+  auto shrink_to_fit() -> void;
+
+  // uses `size` bytes at `data` without copying, they must outlive the array or the next `clear`
+  auto borrow(uint8_t *data, std::size_t size) -> void;
+
+  // returns an array with the same bytes, both arrays share them until one is written to
+  // borrowed bytes without an owner, like a mapped snapshot, are copied instead
+  [[nodiscard]] auto share() -> ByteArray;
+
+  // copies shared bytes into owned memory
+  auto detach() -> void;
 };
 
 struct ComponentArray {
@@ -95,23 +346,56 @@ struct ComponentArray {
   std::size_t each_size = 0;
   std::size_t count = 0;
   void (*fn_destructor)(void *component) = nullptr;
-  std::vector<uint8_t> array;
+  void (*fn_copy)(void *dst, const void *src) = nullptr;
+  bool copyable = true;
+  ByteArray array;
+  std::pmr::vector<uint64_t> enabled_bits; // <-- empty while every row is enabled, else `(count + 63) / 64` words
+  std::size_t disabled_count = 0;
 
   ComponentArray() = default;
-  ComponentArray(ComponentId id, std::size_t each_size, void (*fn_destructor)(void *component));
+  explicit ComponentArray(const ComponentInfo &info,
+                          std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
-  [[nodiscard]] inline auto to_component_info() -> ComponentInfo {
+  [[nodiscard]] inline auto to_component_info() const -> ComponentInfo {
     return {
       .id = id,
       .size = each_size,
       .fn_destructor = fn_destructor,
+      .fn_copy = fn_copy,
+      .copyable = copyable,
     };
   }
 
   [[nodiscard]] auto get_last() -> std::span<uint8_t>;
   [[nodiscard]] auto get_at(EntityIndex index) -> std::span<uint8_t>;
+  [[nodiscard]] auto get_at(EntityIndex index) const -> std::span<const uint8_t>; // <-- reads never copy shared bytes
   auto set_at(EntityIndex index, std::span<uint8_t> value) -> void;
 
+  auto reserve(std::size_t n) -> void;
+  auto shrink_to_fit() -> void;
+  auto push_uninitialized() -> void;
+  auto push_uninitialized(std::size_t n) -> void;
+  auto push_copies(EntityIndex index, std::size_t n) -> void; // <-- appends `n` copies of a row and its enabled bit
+
+  // fills the empty array with the rows of `other`, memcpy-able columns share their bytes with `other` if `share`
+  // rows of a column that isn't copyable are copied with `fn_copy_uncopyable`
+  auto copy_from(ComponentArray &other, bool share = true, const CopyComponentFn &fn_copy_uncopyable = {}) -> void;
+
+  // moves every row of `other` to the end of the array and leaves `other` empty
+  // an empty array takes the bytes of `other` without copying when both use the same memory resource
+  auto append(ComponentArray &other) -> void;
+
+  [[nodiscard]] inline auto enabled_word(std::size_t word) const -> uint64_t {
+    return enabled_bits.empty() ? ~uint64_t{} : enabled_bits[word];
+  }
+
+  [[nodiscard]] inline auto is_enabled(EntityIndex index) const -> bool {
+    return (enabled_word(index.i / 64) >> (index.i % 64) & 1) != 0;
+  }
+
+  auto set_enabled(EntityIndex index, bool enabled) -> void;
+  auto clear_bits_after_last() -> void;
+
   auto take_out_at(EntityIndex index) -> void;
   auto delete_at(EntityIndex index) -> void;
   auto delete_all() -> void;
@@ -120,15 +404,20 @@ struct ComponentArray {
 enum CommandType : std::size_t {
   CreateEntity,
   DeleteEntity,
+  DeleteAll,
   AddComponent,
   RemoveComponent,
 };
 
 struct ReadOnlyEntity;
 struct PendingEntity;
+struct Query;
 
 struct AlignedByteBuffer {
-  std::vector<uint8_t> buf;
+  std::pmr::vector<uint8_t> buf;
+
+  AlignedByteBuffer() = default;
+  explicit AlignedByteBuffer(std::pmr::memory_resource *resource) : buf{resource} {}
 
   [[nodiscard]] inline auto size() const noexcept -> std::size_t {
     return buf.size();
@@ -147,7 +436,7 @@ struct AlignedByteBuffer {
   }
 
   auto get_ptr_at(std::size_t index) -> void * {
-    return &buf[index];
+    return buf.data() + index;
   }
 
   template <typename T, typename... Args>
@@ -187,63 +476,146 @@ struct Command {
   [[nodiscard]] auto create_entity() -> PendingEntity;
   auto delete_entity(ReadOnlyEntity entity) -> void;
   auto delete_entity(PendingEntity entity) -> void;
+  auto delete_all(const Query &query) -> void;
 
   template <typename T, typename... Args>
-  auto add_component(Entity entity, Args &&...args) -> void {
-    aligned_buf.emplace_back<CommandType>(CommandType::AddComponent);
-    aligned_buf.emplace_back<Entity>(entity);
-    aligned_buf.emplace_back<std::size_t>(typeid(T).hash_code());
-
-    // destructor
-    aligned_buf.emplace_back<void (*)(void *)>([](void *component) {
-      std::destroy_at(static_cast<T *>(component));
-    });
-
-    // component size
-    aligned_buf.emplace_back<std::size_t>(sizeof(T));
-
-    // component data index
-    aligned_buf.emplace_back<std::size_t>(aligned_buf.get_aligned_index_at<T>(
-      aligned_buf.get_aligned_index_at<std::size_t>(aligned_buf.size()) + sizeof(std::size_t)));
-
-    // component data
-    aligned_buf.emplace_back<T>(args...);
-  }
+  auto add_component(Entity entity, Args &&...args) -> void;
 
   template <typename T>
   auto remove_component(Entity entity) -> void {
     aligned_buf.emplace_back<CommandType>(CommandType::RemoveComponent);
     aligned_buf.emplace_back<Entity>(entity);
-    aligned_buf.emplace_back<std::size_t>(typeid(T).hash_code());
+    aligned_buf.emplace_back<std::size_t>(component_id<T>().value);
   }
 
-  auto run() -> void;
+  // returns false without running anything if the commands can't be appended to the storage's command log,
+  // they are kept so they can be run again or discarded
+  auto run() -> bool;
   auto discard() -> void;
 };
 
+// Value of a shared component in an archetype signature.
+// Equal values are interned, so the address identifies the value.
+struct SharedValue {
+  ComponentId id;
+  const void *value = nullptr;
+
+  auto operator==(const SharedValue &other) const -> bool = default;
+};
+
+// Interned values of a shared component, each distinct value is stored once.
+// Archetypes hold a reference to each of their values and `ArchetypeStorage::compact` frees the values that lost
+// their last archetype.
+// Values with a std::hash are found by hash, others by comparing them one by one, which suits the few distinct
+// values of meshes or materials.
+struct SharedValueSet {
+  ComponentInfo info;
+  std::pmr::unordered_map<void *, std::size_t> values;      // <-- each value and the number of archetypes using it
+  std::pmr::unordered_multimap<std::size_t, void *> hashed; // <-- `values` by hash if the component has `fn_hash`
+
+  SharedValueSet(const ComponentInfo &info, std::pmr::memory_resource *resource);
+  SharedValueSet(const SharedValueSet &other) = delete;
+  ~SharedValueSet();
+
+  auto operator=(const SharedValueSet &other) -> SharedValueSet & = delete;
+
+  [[nodiscard]] auto find(const void *value) const -> const void *;
+
+  // returns the stored value equal to `value`, `value` is moved by memcpy if it is new or destroyed otherwise
+  [[nodiscard]] auto intern(void *value) -> const void *;
+
+  // like `intern` but copies `value`
+  [[nodiscard]] auto intern_copy(const void *value) -> const void *;
+
+  // adds an allocated value without looking for an equal one
+  auto insert(void *value) -> void;
+
+  auto retain(const void *value) -> void;
+  auto release(const void *value) -> void;
+
+  // frees the values without archetypes
+  auto erase_unused() -> void;
+};
+
 struct Archetype {
+  static constexpr auto no_column = ~std::size_t{}; // <-- column index of tags and missing components
+
   ArchetypeId id;
   ArchetypeStorage *arch_storage = nullptr;
-  std::vector<ComponentId> component_ids; // <-- sorted in ascending order
-  std::vector<Entity> entities;
-  std::vector<ComponentArray> components;
+  std::size_t signature_hash = 0; // <-- hash of `component_ids`
+  std::pmr::vector<ComponentId> component_ids; // <-- sorted in ascending order, includes tags
+  std::pmr::vector<Entity> entities;
+  std::pmr::vector<ComponentArray> components; // <-- sorted in ascending order, tags have no column
+  std::pmr::vector<std::size_t> column_table;  // <-- column index by ComponentId, `no_column` if there is none
+  std::pmr::vector<SharedValue> shared_values; // <-- sorted by id, part of the signature
 
   explicit Archetype(ArchetypeId id, ArchetypeStorage *arch_storage);
   Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, const ComponentInfo &info);
-  Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, std::span<ComponentInfo> infos);
+  Archetype(ArchetypeId id, ArchetypeStorage *arch_storage, std::span<ComponentInfo> infos,
+            std::span<const SharedValue> shared_values = {});
 
   auto delete_all_entities() -> void;
+  auto reserve(std::size_t n) -> void;
+  auto shrink_to_fit() -> void;
 
   [[nodiscard]] auto has_component(ComponentId id) -> bool;
   [[nodiscard]] auto has_components(std::span<ComponentId> ids) -> bool;
   [[nodiscard]] auto not_has_components(std::span<ComponentId> ids) -> bool;
 
+  // returns nullptr for tags
+  [[nodiscard]] auto find_column(ComponentId id) -> ComponentArray *;
+  [[nodiscard]] auto component_infos() -> std::vector<ComponentInfo>;
+  [[nodiscard]] auto component_infos_with(const ComponentInfo &info) -> std::vector<ComponentInfo>;
+  [[nodiscard]] auto component_infos_without(ComponentId id) -> std::vector<ComponentInfo>;
+
   template <typename T>
   [[nodiscard]] auto get_component(EntityIndex index) -> T *;
 
+  // returns nullptr if the archetype doesn't have the shared component
+  template <typename T>
+  [[nodiscard]] auto get_shared() const -> const T * {
+    static_assert(SharedComponent<T>);
+    const auto id = component_id<T>();
+    const auto it = std::ranges::lower_bound(shared_values, id, std::ranges::less(), &SharedValue::id);
+    return it != shared_values.end() && it->id == id ? static_cast<const T *>(it->value) : nullptr;
+  }
+
   auto add_entity(Entity entity) -> EntityIndex;
   auto take_out_entity(EntityIndex index) -> void;
   auto delete_entity(EntityIndex index) -> void;
+
+  // copies the row's components that `dst` also has and deletes the rest
+  auto move_row(EntityIndex index, Archetype *dst, EntityIndex dst_index) -> void;
+};
+
+// Component storage keyed by entity id.
+// The components are packed in `dense` and `pages` maps an entity id to its index in `dense`.
+struct SparseSet {
+  static constexpr auto page_size = std::size_t{4096};
+  static constexpr auto npos = ~std::size_t{};
+
+  ComponentArray dense;
+  std::pmr::vector<Entity> entities; // <-- owner of each component in `dense`
+  std::pmr::vector<std::pmr::vector<std::size_t>> pages;
+
+  SparseSet(const ComponentInfo &info, std::pmr::memory_resource *resource);
+
+  [[nodiscard]] auto find(Entity entity) const -> std::size_t;
+
+  [[nodiscard]] inline auto contains(Entity entity) const -> bool {
+    return find(entity) != npos;
+  }
+
+  [[nodiscard]] auto get(Entity entity) -> void *;
+
+  // returns uninitialized memory for the component of `entity`
+  [[nodiscard]] auto insert(Entity entity) -> void *;
+
+  // maps `entity` to the next row of `dense` without adding the row
+  auto link(Entity entity) -> void;
+  auto take_out(Entity entity) -> void;
+  auto erase(Entity entity) -> void;
+  auto delete_all() -> void;
 };
 
 struct EntityLocation {
@@ -256,149 +628,384 @@ struct ComponentLocation {
   std::size_t index = 0;
 };
 
-using ComponentMap = std::unordered_map<Archetype *, std::size_t>;
+using ComponentMap = std::pmr::unordered_map<Archetype *, std::size_t>;
 
 struct ArchetypeStorage {
-  std::unordered_map<ArchetypeId, Archetype> archetypes;
-  std::unordered_map<Entity, EntityLocation> entity_locations;
-  std::unordered_map<ComponentId, ComponentMap> component_locations;
-
-  ArchetypeStorage();
+  std::pmr::memory_resource *resource = nullptr; // <-- every container of the storage allocates from this
+  std::pmr::vector<std::shared_ptr<void>> mapped_snapshots; // <-- files that columns borrow memory from
+  std::pmr::vector<Archetype *> archetypes;      // <-- indexed by ArchetypeId, erased archetypes leave a nullptr
+  std::pmr::vector<ArchetypeId> free_archetype_ids;
+  std::pmr::vector<std::size_t> archetype_table; // <-- open addressing set of ArchetypeId + 1 by signature, 0 is empty
+  std::size_t archetype_count = 0;
+  std::pmr::unordered_map<Entity, EntityLocation> entity_locations;
+  std::pmr::unordered_map<ComponentId, ComponentMap> component_locations; // <-- archetypes of each component for queries
+  std::pmr::unordered_map<ComponentId, SparseSet> sparse_sets;
+  std::pmr::unordered_map<ComponentId, SharedValueSet> shared_value_sets;
+  std::size_t arch_version = 0;       // <-- changes whenever an archetype is created or erased
+  std::size_t structural_version = 0; // <-- changes whenever an entity can change its archetype or row
+  CommandLog *command_log = nullptr;  // <-- every `Command::run` appends its commands here before running them
+
+  explicit ArchetypeStorage(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+  ArchetypeStorage(const ArchetypeStorage &other) = delete;
   ~ArchetypeStorage();
 
+  auto operator=(const ArchetypeStorage &other) -> ArchetypeStorage & = delete;
+
   auto delete_all_archetypes() -> void;
 
-  static auto calculate_archetype_id(std::span<ComponentInfo> s) -> ArchetypeId;
+  // Returns a copy of the storage in O(archetypes + sparse sets).
+  // Columns of memcpy-able components are shared and a column is copied the first time either storage
+  // writes to it, other components are copied with their copy constructor.
+  // Component pointers taken before the clone still point at the shared bytes, get them again before writing.
+  // With `share_columns` false every column is copied, so the clone never changes after it returns.
+  // The clone allocates from `clone_resource`, or from the storage's resource if it is nullptr.
+  // Components that are not copy constructible are copied one at a time with `fn_copy_uncopyable`, without it
+  // clone throws std::logic_error before copying anything.
+  [[nodiscard]] auto clone(std::pmr::memory_resource *clone_resource = nullptr, bool share_columns = true,
+                           const CopyComponentFn &fn_copy_uncopyable = {}) -> std::unique_ptr<ArchetypeStorage>;
+
+  // Moves every entity of `staging` into the storage, whole columns at a time, and leaves `staging` empty.
+  // Entities keep their ids unless the storage already has them or `new_ids` is set, `remapped_ids` gets the ones
+  // that changed. Handles to the moved entities have to be rebuilt with this storage.
+  auto merge(ArchetypeStorage &&staging, std::unordered_map<EntityId, Entity> *remapped_ids = nullptr,
+             bool new_ids = false) -> void;
+
+  // erases empty archetypes, frees the shared values they were the last to use and shrinks oversized columns
+  auto compact() -> void;
+
+  static auto calculate_signature_hash(std::span<const ComponentInfo> infos,
+                                       std::span<const SharedValue> shared_values = {}) -> std::size_t;
+  auto rebuild_archetype_table(std::size_t table_size) -> void;
+
+  // archetypes are interned by their exact signature, so two signatures never share a table
+  // the signature of an archetype with shared components also includes their values, sorted by id
+  [[nodiscard]] auto find_or_create_archetype(std::span<ComponentInfo> infos,
+                                              std::span<const SharedValue> shared_values = {}) -> Archetype *;
+
+  [[nodiscard]] auto get_shared_value_set(const ComponentInfo &info) -> SharedValueSet &;
+
+  // interns a shared value like `SharedValueSet::intern`
+  [[nodiscard]] auto intern_shared_value(const ComponentInfo &info, void *value) -> SharedValue;
+
+  // interns copies of the shared values of an archetype of another storage
+  // pair targets in `remapped_ids` are changed to the new ids
+  [[nodiscard]] auto copy_shared_values(const Archetype &arch,
+                                        const std::unordered_map<EntityId, Entity> *remapped_ids = nullptr)
+    -> std::vector<SharedValue>;
+
+  // component infos of the non sparse components in Ts
+  template <typename... Ts>
+  [[nodiscard]] static auto sorted_component_infos() -> std::vector<ComponentInfo> {
+    auto component_infos = std::vector<ComponentInfo>{};
+    ((SparseComponent<Ts> ? void() : component_infos.push_back(component_info<Ts>())), ...);
+    std::ranges::sort(component_infos, std::ranges::less(), &ComponentInfo::id);
+    return component_infos;
+  }
+
+  template <typename... Ts>
+  auto reserve(std::size_t n) -> void {
+    static_assert((not SharedComponent<Ts> && ...), "the archetype of a shared component depends on its value");
+    auto component_infos = sorted_component_infos<Ts...>();
+    auto arch = find_or_create_archetype(component_infos);
+
+    // the entities still to be created need a location as well
+    if (n > arch->entities.size()) {
+      entity_locations.reserve(entity_locations.size() + n - arch->entities.size());
+    }
+    arch->reserve(n);
+  }
 
   [[nodiscard]] auto create_entity() -> Entity;
   auto delete_entity(Entity entity) -> void;
 
+  // creates `n` entities with copies of the components of `prefab`, appended to its archetype in one go
+  // throws std::logic_error without creating anything if a component of `prefab` is not copy constructible
+  [[nodiscard]] auto instantiate(Entity prefab, std::size_t n) -> std::vector<Entity>;
+
+  // creates an entity directly in the archetype of Ts without going through the add_component chain
+  template <typename... Ts>
+    requires(sizeof...(Ts) != 0)
+  [[nodiscard]] auto create_entity(Ts &&...components) -> Entity {
+    auto component_infos = sorted_component_infos<std::remove_cvref_t<Ts>...>();
+
+    // shared values are interned first, they pick the archetype
+    auto shared_values = std::vector<SharedValue>{};
+    const auto intern = [&]<typename T>(T &&component) {
+      using U = std::remove_cvref_t<T>;
+      if constexpr (SharedComponent<U>) {
+        alignas(U) std::byte value[sizeof(U)];
+        std::construct_at(reinterpret_cast<U *>(value), std::forward<T>(component));
+        shared_values.push_back(intern_shared_value(component_info<U>(), value));
+      }
+    };
+    (intern(std::forward<Ts>(components)), ...);
+    std::ranges::sort(shared_values, std::ranges::less(), &SharedValue::id);
+    Archetype *arch = find_or_create_archetype(component_infos, shared_values);
+
+    auto entity = Entity{
+      .id = {++Entity::id_gen},
+      .arch_storage = this,
+    };
+    auto entity_index = arch->add_entity(entity);
+    entity_locations.try_emplace(entity, arch, entity_index);
+
+    const auto construct = [&]<typename T>(T &&component) {
+      using U = std::remove_cvref_t<T>;
+      if constexpr (SparseComponent<U>) {
+        auto ptr = get_sparse_set<U>().insert(entity);
+        if constexpr (not TagComponent<U>) {
+          std::construct_at(static_cast<U *>(ptr), std::forward<T>(component));
+        }
+      } else if constexpr (not TagComponent<U> && not SharedComponent<U>) {
+        std::construct_at(arch->get_component<U>(entity_index), std::forward<T>(component));
+      }
+    };
+    (construct(std::forward<Ts>(components)), ...);
+    return entity;
+  }
+
+  // adding a shared component the entity already has replaces its value
   template <typename T, typename... Args>
   auto add_component(Entity entity, Args &&...args) -> void {
-    auto &entity_loc = entity_locations.at(entity);
-    auto entity_arch = entity_loc.arch;
-    auto entity_index = entity_loc.index;
-
-    // check if the entity has this component
-    const auto component_id = ComponentId{typeid(T).hash_code()};
-    if (entity_arch->has_component(component_id)) {
-      return;
-    }
-
-    const auto it = std::ranges::find_if(entity_arch->component_ids, [=](ComponentId id) {
-      return id > component_id;
-    });
-    const auto insert_index = static_cast<std::size_t>(it - entity_arch->component_ids.begin());
-
-    // setup component infos
-    auto component_infos = std::vector<ComponentInfo>(entity_arch->components.size() + 1);
-    for (auto i = std::size_t{}, x = std::size_t{}; i < component_infos.size(); ++i) {
-      if (i == insert_index) {
-        x = 1;
-        component_infos[i] = {component_id, sizeof(T), [](void *component) {
-                                std::destroy_at(static_cast<T *>(component));
-                              }};
-      } else {
-        component_infos[i] = entity_arch->components[i - x].to_component_info();
+    if constexpr (SharedComponent<T>) {
+      alignas(T) std::byte component[sizeof(T)];
+      std::construct_at(reinterpret_cast<T *>(component), args...);
+      add_component(entity, component_info<T>(), component);
+    } else if constexpr (SparseComponent<T>) {
+      assert(entity_locations.contains(entity));
+
+      auto &sparse_set = get_sparse_set<T>();
+      if (not sparse_set.contains(entity)) {
+        auto ptr = sparse_set.insert(entity);
+        if constexpr (not TagComponent<T>) {
+          std::construct_at(static_cast<T *>(ptr), args...);
+        }
       }
-    }
+    } else {
+      auto &entity_loc = entity_locations.at(entity);
 
-    // get new arch
-    const auto new_arch_id = calculate_archetype_id(component_infos);
-    archetypes.try_emplace(new_arch_id, new_arch_id, this, component_infos);
-    component_locations.try_emplace(component_id);
-
-    auto new_arch = &archetypes.at(new_arch_id);
-    auto new_entity_index = new_arch->add_entity(entity);
-
-    for (auto i = std::size_t{}, x = std::size_t{}; i < new_arch->components.size(); ++i) {
-      auto ptr = new_arch->components[i].get_last().data();
-      if (i == insert_index) {
-        x = 1;
-        // construct new component
-        std::construct_at(reinterpret_cast<T *>(ptr), args...);
-        component_locations.at(component_id).try_emplace(new_arch, i);
-      } else {
-        // copy components
-        std::memcpy(ptr, entity_arch->components[i - x].get_at(entity_index).data(),
-                    entity_arch->components[i - x].each_size);
-        component_locations.at(entity_arch->components[i - x].id).try_emplace(new_arch, i);
+      // check if the entity has this component
+      const auto info = component_info<T>();
+      if (entity_loc.arch->has_component(info.id)) {
+        return;
       }
-    }
 
-    // take out entity from the old arch
-    entity_arch->take_out_entity(entity_index);
+      // get new arch
+      auto component_infos = entity_loc.arch->component_infos_with(info);
+      auto new_arch = find_or_create_archetype(component_infos, entity_loc.arch->shared_values);
+      auto new_entity_index = new_arch->add_entity(entity);
+
+      // construct new component
+      if constexpr (not TagComponent<T>) {
+        std::construct_at(reinterpret_cast<T *>(new_arch->find_column(info.id)->get_last().data()), args...);
+      }
 
-    // update entity location
-    entity_loc.arch = new_arch;
-    entity_loc.index = new_entity_index;
+      move_entity(entity_loc, new_arch, new_entity_index);
+    }
   }
 
   template <typename T>
   auto remove_component(Entity entity) -> void {
-    auto &entity_loc = entity_locations.at(entity);
-    auto entity_arch = entity_loc.arch;
-    auto entity_index = entity_loc.index;
-
-    // check if the entity has this component
-    const auto component_id = ComponentId{typeid(T).hash_code()};
-    if (not entity_arch->has_component(component_id)) {
-      return;
-    }
+    remove_component(entity, component_id<T>());
+  }
 
-    const auto it = std::ranges::find_if(entity_arch->component_ids, [=](ComponentId id) {
-      return id == component_id;
-    });
-    const auto remove_index = static_cast<std::size_t>(it - entity_arch->component_ids.begin());
+  // adds a component from its bytes, `component` is moved by memcpy or destroyed if the entity already has it
+  // shared values are interned and replace the value the entity had
+  auto add_component(Entity entity, const ComponentInfo &info, void *component) -> void;
+  auto remove_component(Entity entity, ComponentId component_id) -> void;
+
+  // moves the entity to a row of `new_arch` that was already added with `Archetype::add_entity`
+  auto move_entity(EntityLocation &entity_loc, Archetype *new_arch, EntityIndex new_entity_index) -> void;
+
+  template <typename T>
+  auto get_sparse_set() -> SparseSet & {
+    const auto info = component_info<T>();
+    auto [it, inserted] = sparse_sets.try_emplace(info.id, info, resource);
+    return it->second;
+  }
+
+  auto delete_sparse_components(Entity entity) -> void;
 
-    // new component infos
-    auto component_infos = std::vector<ComponentInfo>(entity_arch->components.size() - 1);
-    for (auto i = std::size_t{}, x = std::size_t{}; i < component_infos.size(); ++i) {
-      if (i == remove_index) {
-        x = 1;
+  // locations of `entities` sorted by archetype and row, paired with the index in `entities`
+  [[nodiscard]] auto sorted_locations(std::span<const Entity> entities)
+    -> std::pmr::vector<std::pair<EntityLocation, std::size_t>>;
+
+  // calls `fn(i, component)` for the T of every entity, column reads are grouped by archetype
+  template <typename T, typename Fn>
+  auto for_each_component_of(std::span<const Entity> entities, Fn &&fn) -> void {
+    static_assert(not TagComponent<T>, "tags have no data");
+    static_assert(not SharedComponent<T>, "shared components have no rows");
+
+    if constexpr (SparseComponent<T>) {
+      auto &sparse_set = get_sparse_set<T>();
+      for (auto i = std::size_t{}; i < entities.size(); ++i) {
+        auto component = sparse_set.get(entities[i]);
+        assert(component != nullptr);
+        fn(i, static_cast<T *>(component));
+      }
+    } else {
+      const auto id = component_id<T>();
+      Archetype *arch = nullptr;
+      ComponentArray *column = nullptr;
+      for (const auto &[entity_loc, i] : sorted_locations(entities)) {
+        if (entity_loc.arch != arch) {
+          arch = entity_loc.arch;
+          column = arch->find_column(id);
+          assert(column != nullptr);
+        }
+        fn(i, reinterpret_cast<T *>(column->get_at(entity_loc.index).data()));
       }
-      component_infos[i] = entity_arch->components[i + x].to_component_info();
     }
+  }
+
+  // copies the T of each entity to `out[i]`
+  template <typename T>
+  auto gather(std::span<const Entity> entities, std::span<T> out) -> void {
+    assert(out.size() >= entities.size());
+    for_each_component_of<T>(entities, [&](std::size_t i, T *component) {
+      out[i] = *component;
+    });
+  }
 
-    // get new arch
-    const auto new_arch_id = calculate_archetype_id(component_infos);
-    archetypes.try_emplace(new_arch_id, new_arch_id, this, component_infos);
+  // copies `in[i]` to the T of each entity
+  template <typename T>
+  auto scatter(std::span<const Entity> entities, std::span<const T> in) -> void {
+    assert(in.size() >= entities.size());
+    for_each_component_of<T>(entities, [&](std::size_t i, T *component) {
+      *component = in[i];
+    });
+  }
 
-    auto new_arch = &archetypes.at(new_arch_id);
-    auto new_entity_index = new_arch->add_entity(entity);
+  template <typename T>
+  [[nodiscard]] auto try_get_component(Entity entity, const EntityLocation &entity_loc) -> T * {
+    static_assert(not SharedComponent<T>, "shared components are read with get_shared");
 
-    for (auto i = std::size_t{}, x = std::size_t{}; i < entity_arch->components.size(); ++i) {
-      if (i == remove_index) {
-        x = 1;
-        // delete removed component
-        entity_arch->components[i].fn_destructor(entity_arch->components[i].get_at(entity_index).data());
+    if constexpr (SparseComponent<T>) {
+      auto it = sparse_sets.find(component_id<T>());
+      if (it == sparse_sets.end() || not it->second.contains(entity)) {
+        return nullptr;
+      }
+      if constexpr (TagComponent<T>) {
+        return &tag_instance<T>;
       } else {
-        // copy components
-        auto ptr = new_arch->components[i - x].get_last().data();
-        std::memcpy(ptr, entity_arch->components[i].get_at(entity_index).data(), entity_arch->components[i].each_size);
-        component_locations.at(entity_arch->components[i].id).try_emplace(new_arch, i - x);
+        return static_cast<T *>(it->second.get(entity));
       }
+    } else if constexpr (TagComponent<T>) {
+      return entity_loc.arch->has_component(component_id<T>()) ? &tag_instance<T> : nullptr;
+    } else {
+      auto column = entity_loc.arch->find_column(component_id<T>());
+      return column != nullptr ? reinterpret_cast<T *>(column->get_at(entity_loc.index).data()) : nullptr;
     }
+  }
 
-    // take out entity from the old arch
-    entity_arch->take_out_entity(entity_index);
+  // writes every entity and component, the components must be registered with `register_component`
+  // compressed snapshots encode the raw columns field by field, they are smaller but can't be mapped
+  auto save(std::ostream &out, bool compress = false) -> void;
 
-    // update entity location
-    entity_loc.arch = new_arch;
-    entity_loc.index = new_entity_index;
-  }
+  // replaces the entities of the storage with a snapshot written by `save`
+  // the snapshot is read whole before anything is replaced, a snapshot that has another format, unknown components
+  // or is cut short returns false and leaves the storage as it was
+  auto load(std::istream &in) -> bool;
+
+  // writes the entities matched by `query` and their sparse components in the snapshot format
+  // a region is unloaded by saving its partition and then deleting the entities with `query.delete_all()`
+  auto save_partition(Query &query, std::ostream &out, bool compress = false) -> void;
+
+  // appends the entities of a partition or snapshot to the storage, each table is appended at once
+  // the entities get new ids, `remapped_ids` maps the saved ids to them
+  // like `load` nothing is appended if it returns false
+  auto load_partition(std::istream &in, std::unordered_map<EntityId, Entity> *remapped_ids = nullptr) -> bool;
+
+  // like `load` but large columns point into a private mapping of the file instead of being read
+  // pages are only copied when they are written to or when the column grows
+  auto map_snapshot(const std::filesystem::path &path) -> bool;
+
+  // copies the registered components to compute deltas against
+  [[nodiscard]] auto snapshot() -> Snapshot;
+
+  // writes the changes since `prev`: destroyed entities, entities that changed archetype,
+  // changed components and sparse components
+  auto diff(const Snapshot &prev, std::ostream &out) -> void;
+
+  // applies a delta written by `diff`, returns false if it has another format or unknown components
+  auto apply_delta(std::istream &in) -> bool;
+
+  // runs the commands of a log written by `CommandLog`, usually on top of the snapshot the log was started after
+  // stops at the first torn or unknown batch and returns the number of batches that were run
+  auto replay(std::istream &in) -> std::size_t;
+
+  [[nodiscard]] auto find_component_array(Entity entity, ComponentId component_id) -> std::pair<ComponentArray *, EntityIndex>;
+  auto set_enabled(Entity entity, ComponentId component_id, bool enabled) -> void;
+  [[nodiscard]] auto is_enabled(Entity entity, ComponentId component_id) -> bool;
 };
 
+template <typename T, typename... Args>
+auto Command::add_component(Entity entity, Args &&...args) -> void {
+  if constexpr (SparseComponent<T>) {
+    // register the sparse set so `run` knows where the component goes
+    arch_storage->get_sparse_set<T>();
+  }
+
+  aligned_buf.emplace_back<CommandType>(CommandType::AddComponent);
+  aligned_buf.emplace_back<Entity>(entity);
+
+  // id, size, destructor and copy
+  aligned_buf.emplace_back<ComponentInfo>(component_info<T>());
+
+  // component data index
+  aligned_buf.emplace_back<std::size_t>(aligned_buf.get_aligned_index_at<T>(
+    aligned_buf.get_aligned_index_at<std::size_t>(aligned_buf.size()) + sizeof(std::size_t)));
+
+  // component data, tags have none
+  if constexpr (not TagComponent<T>) {
+    aligned_buf.emplace_back<T>(args...);
+  }
+}
+
 template <typename T>
 [[nodiscard]] auto Entity::get_component() -> T * {
+  if constexpr (SparseComponent<T>) {
+    auto &sparse_set = arch_storage->sparse_sets.at(component_id<T>());
+    if constexpr (TagComponent<T>) {
+      assert(sparse_set.contains(*this));
+      return &tag_instance<T>;
+    }
+    auto component = sparse_set.get(*this);
+    assert(component != nullptr);
+    return static_cast<T *>(component);
+  }
+
   auto entity_loc = arch_storage->entity_locations.at(*this);
   auto entity_arch = entity_loc.arch;
 
-  auto component_loc = arch_storage->component_locations.at({typeid(T).hash_code()});
-  assert(component_loc.contains(entity_arch));
+  if constexpr (TagComponent<T>) {
+    assert(entity_arch->has_component(component_id<T>()));
+    return &tag_instance<T>;
+  }
+
+  return entity_arch->get_component<T>(entity_loc.index);
+}
+
+template <typename T>
+[[nodiscard]] auto Entity::get_shared() -> const T * {
+  return arch_storage->entity_locations.at(*this).arch->get_shared<T>();
+}
+
+template <typename... Ts>
+[[nodiscard]] auto Entity::get() -> std::tuple<Ts *...> {
+  const auto &entity_loc = arch_storage->entity_locations.at(*this);
+  auto components = std::tuple<Ts *...>{arch_storage->try_get_component<Ts>(*this, entity_loc)...};
+  assert(std::apply([](auto... component) { return ((component != nullptr) && ...); }, components));
+  return components;
+}
 
-  auto &component_array = entity_arch->components[component_loc.at(entity_arch)];
-  return reinterpret_cast<T *>(&component_array.array[entity_loc.index.i * component_array.each_size]);
+template <typename T>
+[[nodiscard]] auto Entity::try_get() -> T * {
+  auto it = arch_storage->entity_locations.find(*this);
+  if (it == arch_storage->entity_locations.end()) {
+    return nullptr;
+  }
+  return arch_storage->try_get_component<T>(*this, it->second);
 }
 
 template <typename T, typename... Args>
@@ -411,13 +1018,85 @@ auto Entity::remove_component() -> void {
   arch_storage->remove_component<T>(*this);
 }
 
+template <typename T>
+auto Entity::set_enabled(bool enabled) -> void {
+  arch_storage->set_enabled(*this, component_id<T>(), enabled);
+}
+
+template <typename T>
+[[nodiscard]] auto Entity::is_enabled() -> bool {
+  return arch_storage->is_enabled(*this, component_id<T>());
+}
+
 template <typename T>
 [[nodiscard]] auto Archetype::get_component(EntityIndex index) -> T * {
-  auto component_loc = arch_storage->component_locations.at({typeid(T).hash_code()});
-  auto &component_array = components[component_loc.at(this)];
+  static_assert(not SharedComponent<T>, "shared components are read with get_shared");
+
+  if constexpr (TagComponent<T>) {
+    return &tag_instance<T>;
+  }
+
+  const auto id = component_id<T>();
+  assert(id.value < column_table.size() && column_table[id.value] != no_column);
+  auto &component_array = components[column_table[id.value]];
   return reinterpret_cast<T *>(&component_array.array[index.i * component_array.each_size]);
 }
 
+// Entity handle with a cached archetype and row.
+// Component access is a column load until a structural change happens, then the location is looked up again.
+struct ResolvedEntity {
+  Entity entity;
+  Archetype *arch = nullptr;
+  EntityIndex index;
+  std::size_t structural_version = 0;
+
+  auto resolve() -> void;
+
+  template <typename T>
+  [[nodiscard]] auto get_component() -> T * {
+    if (structural_version != entity.arch_storage->structural_version) {
+      resolve();
+    }
+
+    if constexpr (SparseComponent<T>) {
+      return entity.get_component<T>();
+    } else {
+      return arch->get_component<T>(index);
+    }
+  }
+
+  template <typename T>
+  [[nodiscard]] auto get_shared() -> const T * {
+    if (structural_version != entity.arch_storage->structural_version) {
+      resolve();
+    }
+    return arch->get_shared<T>();
+  }
+
+  template <typename... Ts>
+  [[nodiscard]] auto get() -> std::tuple<Ts *...> {
+    if (structural_version != entity.arch_storage->structural_version) {
+      resolve();
+    }
+
+    const auto entity_loc = EntityLocation{arch, index};
+    auto components = std::tuple<Ts *...>{entity.arch_storage->try_get_component<Ts>(entity, entity_loc)...};
+    assert(std::apply([](auto... component) { return ((component != nullptr) && ...); }, components));
+    return components;
+  }
+
+  template <typename T>
+  [[nodiscard]] auto try_get() -> T * {
+    if (structural_version != entity.arch_storage->structural_version) {
+      if (not entity.arch_storage->entity_locations.contains(entity)) {
+        return nullptr;
+      }
+      resolve();
+    }
+    return entity.arch_storage->try_get_component<T>(entity, {arch, index});
+  }
+};
+
 struct ReadOnlyEntity {
   Command *command = nullptr;
   ArchetypeStorage *arch_storage = nullptr;
@@ -427,7 +1106,16 @@ struct ReadOnlyEntity {
 
   template <typename T>
   [[nodiscard]] auto get_component() -> T * {
-    return arch->get_component<T>(index);
+    if constexpr (SparseComponent<T>) {
+      return Entity{id, arch_storage}.get_component<T>();
+    } else {
+      return arch->get_component<T>(index);
+    }
+  }
+
+  template <typename T>
+  [[nodiscard]] auto get_shared() const -> const T * {
+    return arch->get_shared<T>();
   }
 
   template <typename T, typename... Args>
@@ -439,6 +1127,17 @@ struct ReadOnlyEntity {
   auto remove_component() -> void {
     command->remove_component<T>({id, arch_storage});
   }
+
+  // toggling doesn't change the archetype so it isn't deferred
+  template <typename T>
+  auto set_enabled(bool enabled) -> void {
+    Entity{id, arch_storage}.set_enabled<T>(enabled);
+  }
+
+  template <typename T>
+  [[nodiscard]] auto is_enabled() -> bool {
+    return Entity{id, arch_storage}.is_enabled<T>();
+  }
 };
 
 struct PendingEntity {
@@ -459,14 +1158,20 @@ struct PendingEntity {
 
 struct Query {
   ArchetypeStorage *arch_storage = nullptr;
-  std::size_t arch_count = 0;
+  std::size_t arch_version = 0;
   std::vector<ComponentId> includes;
   std::vector<ComponentId> excludes;
+  std::vector<SparseSet *> sparse_includes;
+  std::vector<SparseSet *> sparse_excludes;
   ComponentMap archs;
   ComponentMap::iterator archs_it;
+  std::vector<ComponentArray *> include_columns; // <-- columns of `includes` in the current archetype
   std::size_t index = 0;
 
   Query(ArchetypeStorage *arch_storage);
+  Query(const Query &other);
+
+  auto operator=(const Query &other) -> Query &;
 
   template <typename Map, typename Key = typename Map::key_type>
   static inline auto unorderd_map_intersection(Map &s, const Map &other) -> void {
@@ -489,21 +1194,43 @@ struct Query {
 
   template <typename... T>
   auto with() -> Query {
-    includes = {{typeid(T).hash_code()}...};
+    includes.clear();
+    sparse_includes.clear();
+    ((SparseComponent<T> ? sparse_includes.push_back(&arch_storage->get_sparse_set<T>())
+                         : includes.push_back(component_id<T>())),
+     ...);
     std::ranges::sort(includes, std::ranges::less());
     return *this;
   }
 
   template <typename... T>
   auto without() -> Query {
-    excludes = {{typeid(T).hash_code()}...};
+    excludes.clear();
+    sparse_excludes.clear();
+    ((SparseComponent<T> ? sparse_excludes.push_back(&arch_storage->get_sparse_set<T>())
+                         : excludes.push_back(component_id<T>())),
+     ...);
     std::ranges::sort(excludes, std::ranges::less());
     return *this;
   }
 
+  // shared value of the archetype being iterated, the same for every entity until the query moves to the next one
+  template <typename T>
+  [[nodiscard]] auto get_shared() const -> const T * {
+    assert(not includes.empty() || sparse_includes.empty());
+    return archs_it != archs.end() ? archs_it->first->get_shared<T>() : nullptr;
+  }
+
   auto update_archs() -> void;
   auto start() -> void;
+  auto update_include_columns() -> void;
+  [[nodiscard]] auto next_enabled_index(std::size_t count) const -> std::size_t;
+  [[nodiscard]] auto matches_sparse(Entity entity) const -> bool;
   [[nodiscard]] auto get_next_entity(Command *command) -> ReadOnlyEntity;
+  [[nodiscard]] auto get_next_sparse_entity(Command *command) -> ReadOnlyEntity;
+
+  auto delete_all() -> void;
+  auto delete_all(Command *command) -> void;
 };
 
 #define for_each_entities(arch_storage, command, query) \
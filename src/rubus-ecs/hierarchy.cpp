@@ -0,0 +1,82 @@
+#include "hierarchy.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+namespace ruecs {
+
+Hierarchy::Hierarchy(ArchetypeStorage *arch_storage) : arch_storage{arch_storage} {}
+
+auto Hierarchy::update() -> void {
+  if (arch_version == arch_storage->arch_version && structural_version == arch_storage->structural_version) {
+    return;
+  }
+  arch_version = arch_storage->arch_version;
+  structural_version = arch_storage->structural_version;
+  batches.clear();
+
+  const auto children = arch_storage->component_locations.find(component_id<ChildOf>());
+  if (children == arch_storage->component_locations.end()) {
+    return;
+  }
+
+  const auto parent_location = [&](const Archetype *arch) -> const EntityLocation * {
+    const auto parent = Entity{arch->get_shared<ChildOf>()->target, arch_storage};
+    const auto it = arch_storage->entity_locations.find(parent);
+    return it != arch_storage->entity_locations.end() ? &it->second : nullptr;
+  };
+
+  // every table has one parent, so depths are found per table by walking up the parents' tables
+  auto depths = std::unordered_map<const Archetype *, std::size_t>{};
+  auto path = std::vector<const Archetype *>{};
+  const auto depth_of = [&](const Archetype *arch) {
+    path.clear();
+    auto depth = std::size_t{};
+    while (true) {
+      if (const auto it = depths.find(arch); it != depths.end()) {
+        depth = it->second;
+        break;
+      }
+      path.push_back(arch);
+
+      const auto parent_loc = parent_location(arch);
+      if (parent_loc == nullptr || parent_loc->arch->get_shared<ChildOf>() == nullptr) {
+        break;
+      }
+      arch = parent_loc->arch;
+
+      if (path.size() > arch_storage->archetype_count) {
+        assert(false && "ChildOf has a cycle");
+        break;
+      }
+    }
+
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      depths[*it] = ++depth;
+    }
+    return depth;
+  };
+
+  for (const auto &[arch, _] : children->second) {
+    if (arch->entities.empty()) {
+      continue;
+    }
+
+    const auto parent_loc = parent_location(arch);
+    const auto parent = ReadOnlyEntity{
+      .command = nullptr,
+      .arch_storage = arch_storage,
+      .arch = parent_loc != nullptr ? parent_loc->arch : nullptr,
+      .index = parent_loc != nullptr ? parent_loc->index : EntityIndex{},
+      .id = arch->get_shared<ChildOf>()->target,
+    };
+    batches.push_back({arch, parent, depth_of(arch)});
+  }
+
+  std::ranges::sort(batches, std::ranges::less(), [](const Batch &batch) {
+    return std::pair{batch.depth, batch.arch->id.value};
+  });
+}
+
+} // namespace ruecs
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ecs.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace ruecs {
+
+// Breadth-first view of the `ChildOf` hierarchy.
+// Children of the same parent share a table, `batches` lists those tables by depth so every parent comes before
+// its children and propagating transforms is one pass over the tables, with one parent lookup per table.
+struct Hierarchy {
+  struct Batch {
+    Archetype *arch = nullptr; // <-- the children
+    ReadOnlyEntity parent;     // <-- `parent.arch` is nullptr if the parent was deleted
+    std::size_t depth = 0;     // <-- 1 for children of entities without a parent
+  };
+
+  ArchetypeStorage *arch_storage = nullptr;
+  std::size_t arch_version = ~std::size_t{};
+  std::size_t structural_version = ~std::size_t{};
+  std::vector<Batch> batches; // <-- sorted by depth
+
+  explicit Hierarchy(ArchetypeStorage *arch_storage);
+
+  // sorts the tables again if archetypes changed or entities moved since the last update
+  auto update() -> void;
+
+  // calls `fn(parent, child)` for every entity with a parent, parents first
+  template <typename Fn>
+  auto for_each(Fn &&fn) -> void {
+    update();
+    for (const auto &batch : batches) {
+      for (auto i = std::size_t{}; i < batch.arch->entities.size(); ++i) {
+        fn(batch.parent, ReadOnlyEntity{nullptr, arch_storage, batch.arch, {i}, batch.arch->entities[i].id});
+      }
+    }
+  }
+};
+
+} // namespace ruecs
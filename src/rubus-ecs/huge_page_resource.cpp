@@ -0,0 +1,172 @@
+#include "huge_page_resource.hpp"
+
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace ruecs {
+
+namespace {
+
+[[nodiscard]] auto round_up(std::size_t size, std::size_t granularity) -> std::size_t {
+  return (size + granularity - 1) / granularity * granularity;
+}
+
+[[nodiscard]] auto reserve_pages(std::size_t size) -> uint8_t * {
+#ifdef _WIN32
+  return static_cast<uint8_t *>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+#else
+  auto ptr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return ptr == MAP_FAILED ? nullptr : static_cast<uint8_t *>(ptr);
+#endif
+}
+
+auto release_pages(uint8_t *ptr, [[maybe_unused]] std::size_t size) -> void {
+#ifdef _WIN32
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munmap(ptr, size);
+#endif
+}
+
+[[nodiscard]] auto commit_pages(uint8_t *ptr, std::size_t size) -> bool {
+#ifdef _WIN32
+  return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  // transparent huge pages are only a hint
+  madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+  return true;
+#endif
+}
+
+auto decommit_pages(uint8_t *ptr, std::size_t size) -> void {
+#ifdef _WIN32
+  VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+  madvise(ptr, size, MADV_DONTNEED);
+  mprotect(ptr, size, PROT_NONE);
+#endif
+}
+
+} // namespace
+
+HugePageResource::HugePageResource(std::size_t reserve_size, std::size_t slot_size, std::size_t min_slot_allocation,
+                                   std::pmr::memory_resource *upstream)
+    : upstream{upstream}, slot_size{round_up(slot_size, commit_granularity)},
+      min_slot_allocation{min_slot_allocation} {
+  const auto slot_count = reserve_size / this->slot_size;
+  if (slot_count == 0) {
+    return;
+  }
+
+  // over reserve so the slots can start at a huge page boundary
+  reserved_size = slot_count * this->slot_size + commit_granularity;
+  reserved = reserve_pages(reserved_size);
+  if (reserved == nullptr) {
+    reserved_size = 0;
+    return;
+  }
+
+  const auto addr = reinterpret_cast<std::uintptr_t>(reserved);
+  base = reserved + (round_up(addr, commit_granularity) - addr);
+  committed.resize(slot_count);
+}
+
+HugePageResource::~HugePageResource() {
+  if (reserved != nullptr) {
+    release_pages(reserved, reserved_size);
+  }
+}
+
+auto HugePageResource::owns(const void *ptr) const noexcept -> bool {
+  auto p = static_cast<const uint8_t *>(ptr);
+  return base != nullptr && p >= base && p < base + slot_count() * slot_size;
+}
+
+auto HugePageResource::try_resize(void *ptr, std::size_t new_size) -> bool {
+  if (not owns(ptr) || new_size > slot_size) {
+    return false;
+  }
+
+  const auto offset = static_cast<std::size_t>(static_cast<uint8_t *>(ptr) - base);
+  if (offset % slot_size != 0) {
+    return false;
+  }
+
+  return commit(offset / slot_size, new_size);
+}
+
+auto HugePageResource::do_allocate(std::size_t bytes, std::size_t alignment) -> void * {
+  if (bytes < min_slot_allocation || bytes > slot_size || alignment > commit_granularity) {
+    return upstream->allocate(bytes, alignment);
+  }
+
+  auto slot = std::size_t{};
+  {
+    auto lock = std::scoped_lock{mutex};
+    if (not free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else if (next_slot < slot_count()) {
+      slot = next_slot++;
+    } else {
+      // address space is exhausted
+      return upstream->allocate(bytes, alignment);
+    }
+  }
+
+  if (not commit(slot, bytes)) {
+    auto lock = std::scoped_lock{mutex};
+    free_slots.push_back(slot);
+    throw std::bad_alloc{};
+  }
+
+  return base + slot * slot_size;
+}
+
+auto HugePageResource::do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) -> void {
+  if (not owns(ptr)) {
+    upstream->deallocate(ptr, bytes, alignment);
+    return;
+  }
+
+  const auto slot = static_cast<std::size_t>(static_cast<uint8_t *>(ptr) - base) / slot_size;
+  commit(slot, 0);
+
+  auto lock = std::scoped_lock{mutex};
+  free_slots.push_back(slot);
+}
+
+auto HugePageResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept -> bool {
+  return this == &other;
+}
+
+auto HugePageResource::commit(std::size_t slot, std::size_t size) -> bool {
+  const auto slot_ptr = base + slot * slot_size;
+  const auto old_committed = committed[slot];
+  const auto new_committed = round_up(size, commit_granularity);
+
+  if (new_committed > old_committed) {
+    if (not commit_pages(slot_ptr + old_committed, new_committed - old_committed)) {
+      return false;
+    }
+  } else if (new_committed < old_committed) {
+    decommit_pages(slot_ptr + new_committed, old_committed - new_committed);
+  }
+
+  committed[slot] = new_committed;
+  return true;
+}
+
+} // namespace ruecs
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+namespace ruecs {
+
+// Memory resource for large worlds.
+// It reserves one virtual address range up front and splits it into fixed size slots.
+// Large allocations (component columns) get a whole slot whose pages are committed on demand,
+// so a column can grow in place until the slot is full and growth never copies.
+// Small allocations are forwarded to the upstream resource.
+struct HugePageResource : std::pmr::memory_resource {
+  static constexpr auto commit_granularity = std::size_t{2} << 20; // <-- huge page size
+
+  std::pmr::memory_resource *upstream = nullptr;
+  std::size_t slot_size = 0;
+  std::size_t min_slot_allocation = 0;
+  std::size_t reserved_size = 0;
+  uint8_t *reserved = nullptr;
+  uint8_t *base = nullptr; // <-- `reserved` aligned to `commit_granularity`
+
+  std::mutex mutex;
+  std::vector<std::size_t> committed; // <-- committed bytes of each slot
+  std::vector<std::size_t> free_slots;
+  std::size_t next_slot = 0;
+
+  explicit HugePageResource(std::size_t reserve_size, std::size_t slot_size = std::size_t{1} << 30,
+                            std::size_t min_slot_allocation = std::size_t{1} << 20,
+                            std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+  HugePageResource(const HugePageResource &other) = delete;
+  ~HugePageResource() override;
+
+  auto operator=(const HugePageResource &other) -> HugePageResource & = delete;
+
+  [[nodiscard]] inline auto slot_count() const noexcept -> std::size_t {
+    return committed.size();
+  }
+
+  [[nodiscard]] auto owns(const void *ptr) const noexcept -> bool;
+
+  // Commits or decommits the pages of a slot so it holds `new_size` bytes without moving.
+  // Returns false if `ptr` is not a slot or `new_size` does not fit in a slot.
+  auto try_resize(void *ptr, std::size_t new_size) -> bool;
+
+protected:
+  auto do_allocate(std::size_t bytes, std::size_t alignment) -> void * override;
+  auto do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) -> void override;
+  auto do_is_equal(const std::pmr::memory_resource &other) const noexcept -> bool override;
+
+  auto commit(std::size_t slot, std::size_t size) -> bool;
+};
+
+} // namespace ruecs
@@ -0,0 +1,1721 @@
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ruecs {
+
+namespace {
+
+constexpr auto snapshot_magic = uint64_t{0x50414e5343455552}; // <-- "RUECSNAP"
+constexpr auto snapshot_version = uint64_t{6};
+constexpr auto snapshot_compressed = uint64_t{1}; // <-- header flag, raw columns are encoded
+constexpr auto delta_magic = uint64_t{0x41544c4443455552}; // <-- "RUECDLTA"
+constexpr auto delta_version = uint64_t{2};
+constexpr auto log_magic = uint64_t{0x474f4c5343455552}; // <-- "RUECSLOG"
+constexpr auto log_version = uint64_t{1};
+
+// Raw columns at least this large start at a page boundary of the snapshot so they can be mapped.
+constexpr auto mapped_page_size = std::size_t{4096};
+constexpr auto min_mapped_column_size = std::size_t{64} << 10;
+
+[[nodiscard]] auto is_mapped_column(const RegisteredComponent &component, std::size_t size) -> bool {
+  return component.trivially_copyable && size >= min_mapped_column_size;
+}
+
+// Compressed snapshots split raw columns into lanes, one per 4 byte field of the component or one per byte if
+// the size isn't a multiple of 4, and write each lane with the encoding that comes out smallest.
+enum class LaneEncoding : uint8_t {
+  Raw,
+  Delta,    // <-- zigzag varints of the difference to the previous row, for counters and ids
+  Xor,      // <-- varints of the xor with the previous row, floats that change slowly share their high bits
+  RunLength // <-- varint run lengths and raw values, for constants and flags
+};
+
+auto write_varint(std::string &out, uint64_t value) -> void {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+[[nodiscard]] auto read_varint(std::string_view &in, uint64_t &value) -> bool {
+  value = 0;
+  for (auto shift = 0; shift < 64 && not in.empty(); shift += 7) {
+    const auto byte = static_cast<uint8_t>(in.front());
+    in.remove_prefix(1);
+    value |= uint64_t{byte & 0x7fu} << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct Lane {
+  std::size_t width = 0;  // <-- 1 or 4 bytes
+  std::size_t offset = 0; // <-- in the row
+  std::size_t stride = 0; // <-- row size
+
+  [[nodiscard]] auto mask() const -> uint64_t {
+    return (uint64_t{1} << (width * 8)) - 1;
+  }
+
+  [[nodiscard]] auto load(const uint8_t *rows, std::size_t i) const -> uint64_t {
+    auto value = uint64_t{};
+    std::memcpy(&value, rows + i * stride + offset, width);
+    return value;
+  }
+
+  auto store(uint8_t *rows, std::size_t i, uint64_t value) const -> void {
+    std::memcpy(rows + i * stride + offset, &value, width);
+  }
+};
+
+auto encode_lane(const Lane &lane, const uint8_t *rows, std::size_t n, LaneEncoding encoding, std::string &out) -> void {
+  const auto sign_bit = uint64_t{1} << (lane.width * 8 - 1);
+  auto prev = uint64_t{};
+  switch (encoding) {
+  case LaneEncoding::Raw:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      const auto value = lane.load(rows, i);
+      out.append(reinterpret_cast<const char *>(&value), lane.width);
+    }
+    break;
+  case LaneEncoding::Delta:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      const auto value = lane.load(rows, i);
+      const auto delta = (value - prev) & lane.mask();
+      const auto signed_delta = static_cast<int64_t>((delta ^ sign_bit) - sign_bit);
+      write_varint(out, (static_cast<uint64_t>(signed_delta) << 1) ^ static_cast<uint64_t>(signed_delta >> 63));
+      prev = value;
+    }
+    break;
+  case LaneEncoding::Xor:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      const auto value = lane.load(rows, i);
+      write_varint(out, value ^ prev);
+      prev = value;
+    }
+    break;
+  case LaneEncoding::RunLength:
+    for (auto i = std::size_t{}; i < n;) {
+      const auto value = lane.load(rows, i);
+      auto run = std::size_t{1};
+      while (i + run < n && lane.load(rows, i + run) == value) {
+        ++run;
+      }
+      write_varint(out, run);
+      out.append(reinterpret_cast<const char *>(&value), lane.width);
+      i += run;
+    }
+    break;
+  }
+}
+
+[[nodiscard]] auto decode_lane(const Lane &lane, uint8_t *rows, std::size_t n, LaneEncoding encoding,
+                               std::string_view &in) -> bool {
+  auto prev = uint64_t{};
+  auto value = uint64_t{};
+  switch (encoding) {
+  case LaneEncoding::Raw:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      if (in.size() < lane.width) {
+        return false;
+      }
+      value = 0;
+      std::memcpy(&value, in.data(), lane.width);
+      in.remove_prefix(lane.width);
+      lane.store(rows, i, value);
+    }
+    return true;
+  case LaneEncoding::Delta:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      if (not read_varint(in, value)) {
+        return false;
+      }
+      prev = (prev + ((value >> 1) ^ (~(value & 1) + 1))) & lane.mask();
+      lane.store(rows, i, prev);
+    }
+    return true;
+  case LaneEncoding::Xor:
+    for (auto i = std::size_t{}; i < n; ++i) {
+      if (not read_varint(in, value)) {
+        return false;
+      }
+      prev ^= value;
+      lane.store(rows, i, prev);
+    }
+    return true;
+  case LaneEncoding::RunLength:
+    for (auto i = std::size_t{}; i < n;) {
+      auto run = uint64_t{};
+      if (not read_varint(in, run) || run == 0 || run > n - i || in.size() < lane.width) {
+        return false;
+      }
+      value = 0;
+      std::memcpy(&value, in.data(), lane.width);
+      in.remove_prefix(lane.width);
+      for (; run != 0; --run, ++i) {
+        lane.store(rows, i, value);
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+[[nodiscard]] auto column_lanes(std::size_t each_size) -> std::vector<Lane> {
+  const auto width = each_size % 4 == 0 ? std::size_t{4} : std::size_t{1};
+  auto lanes = std::vector<Lane>{};
+  for (auto offset = std::size_t{}; offset < each_size; offset += width) {
+    lanes.push_back({width, offset, each_size});
+  }
+  return lanes;
+}
+
+[[nodiscard]] auto encode_column(const uint8_t *rows, std::size_t each_size, std::size_t n) -> std::string {
+  static constexpr LaneEncoding encodings[] = {LaneEncoding::Raw, LaneEncoding::Delta, LaneEncoding::Xor,
+                                               LaneEncoding::RunLength};
+
+  auto block = std::string{};
+  auto best = std::string{};
+  auto candidate = std::string{};
+  for (const auto &lane : column_lanes(each_size)) {
+    auto best_encoding = LaneEncoding::Raw;
+    best.clear();
+    encode_lane(lane, rows, n, LaneEncoding::Raw, best);
+    for (const auto encoding : std::span{encodings}.subspan(1)) {
+      candidate.clear();
+      encode_lane(lane, rows, n, encoding, candidate);
+      if (candidate.size() < best.size()) {
+        std::swap(best, candidate);
+        best_encoding = encoding;
+      }
+    }
+    block.push_back(static_cast<char>(best_encoding));
+    block += best;
+  }
+  return block;
+}
+
+[[nodiscard]] auto decode_column(std::string_view block, uint8_t *rows, std::size_t each_size, std::size_t n) -> bool {
+  for (const auto &lane : column_lanes(each_size)) {
+    if (block.empty() || static_cast<uint8_t>(block.front()) > static_cast<uint8_t>(LaneEncoding::RunLength)) {
+      return false;
+    }
+    const auto encoding = static_cast<LaneEncoding>(block.front());
+    block.remove_prefix(1);
+    if (not decode_lane(lane, rows, n, encoding, block)) {
+      return false;
+    }
+  }
+  return block.empty();
+}
+
+// counts the written bytes to align the mapped columns
+struct SnapshotWriter {
+  std::ostream &out;
+  std::size_t offset = 0;
+  bool compressed = false;
+
+  auto write_bytes(const void *data, std::size_t size) -> void {
+    out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    offset += size;
+  }
+
+  template <typename T>
+  auto write_value(const T &value) -> void {
+    write_bytes(&value, sizeof(T));
+  }
+
+  auto pad(std::size_t alignment) -> void {
+    static constexpr char zeros[mapped_page_size] = {};
+    write_bytes(zeros, (alignment - offset % alignment) % alignment);
+  }
+
+  // `rows` selects the written entities, all of them if it is empty
+  auto write_entities(std::span<const Entity> entities, std::span<const std::size_t> rows = {}) -> void {
+    auto ids = std::vector<uint64_t>(rows.empty() ? entities.size() : rows.size());
+    for (auto i = std::size_t{}; i < ids.size(); ++i) {
+      ids[i] = entities[rows.empty() ? i : rows[i]].id.value;
+    }
+    write_value(uint64_t{ids.size()});
+    write_bytes(ids.data(), ids.size() * sizeof(uint64_t));
+  }
+
+  // writes the bytes of one component from `component_bytes`
+  auto write_component(const RegisteredComponent &component, std::span<const uint8_t> bytes) -> void {
+    if (not component.trivially_copyable) {
+      write_value(uint64_t{bytes.size()});
+    }
+    write_bytes(bytes.data(), bytes.size());
+  }
+
+  // `rows` selects the written rows like in `write_entities`
+  auto write_column(const ComponentArray &column, const RegisteredComponent &component,
+                    std::span<const std::size_t> rows = {}) -> void {
+    const auto n = rows.empty() ? column.count : rows.size();
+    const auto row = [&](std::size_t i) -> EntityIndex {
+      return {rows.empty() ? i : rows[i]};
+    };
+
+    // enabled bits
+    if (rows.empty() || column.disabled_count == 0) {
+      write_value(uint64_t{column.disabled_count});
+      if (column.disabled_count != 0) {
+        // the reader expects exactly one bit per row, rounded up to words
+        assert(column.enabled_bits.size() == (n + 63) / 64);
+        write_bytes(column.enabled_bits.data(), (n + 63) / 64 * sizeof(uint64_t));
+      }
+    } else {
+      auto enabled_bits = std::vector<uint64_t>((n + 63) / 64, ~uint64_t{});
+      auto disabled_count = uint64_t{};
+      for (auto i = std::size_t{}; i < n; ++i) {
+        if (not column.is_enabled(row(i))) {
+          enabled_bits[i / 64] &= ~(uint64_t{1} << (i % 64));
+          disabled_count += 1;
+        }
+      }
+      write_value(disabled_count);
+      if (disabled_count != 0) {
+        write_bytes(enabled_bits.data(), enabled_bits.size() * sizeof(uint64_t));
+      }
+    }
+
+    // raw components of the selected rows are gathered first
+    auto gathered = std::vector<uint8_t>{};
+    auto bytes = column.array.data();
+    if (component.trivially_copyable && not rows.empty()) {
+      gathered.resize(n * column.each_size);
+      for (auto i = std::size_t{}; i < n; ++i) {
+        std::memcpy(gathered.data() + i * column.each_size, column.get_at(row(i)).data(), column.each_size);
+      }
+      bytes = gathered.data();
+    }
+
+    // components
+    if (component.trivially_copyable && compressed) {
+      const auto block = encode_column(bytes, column.each_size, n);
+      write_value(uint64_t{block.size()});
+      write_bytes(block.data(), block.size());
+    } else if (component.trivially_copyable) {
+      if (is_mapped_column(component, n * column.each_size)) {
+        pad(mapped_page_size);
+      }
+      write_bytes(bytes, n * column.each_size);
+    } else {
+      // serialized components are written as one sized block
+      assert(component.fn_save);
+      auto block = std::ostringstream{};
+      for (auto i = std::size_t{}; i < n; ++i) {
+        component.fn_save(block, column.get_at(row(i)).data());
+      }
+      const auto bytes = std::move(block).str();
+      write_value(uint64_t{bytes.size()});
+      write_bytes(bytes.data(), bytes.size());
+    }
+  }
+};
+
+// bytes left in a seekable stream, unbounded for the others
+[[nodiscard]] auto input_size(std::istream &in) -> std::size_t {
+  const auto begin = in.tellg();
+  if (begin == std::istream::pos_type(-1)) {
+    return ~std::size_t{};
+  }
+  in.seekg(0, std::ios::end);
+  const auto end = in.tellg();
+  in.seekg(begin);
+  return end != std::istream::pos_type(-1) ? static_cast<std::size_t>(end - begin) : ~std::size_t{};
+}
+
+struct SnapshotReader {
+  std::istream &in;
+  uint8_t *mapping = nullptr; // <-- start of the snapshot if it is mapped
+  std::size_t offset = 0;
+  std::size_t size = 0; // <-- bytes in the input, counts are checked against it before anything is allocated
+  bool compressed = false;
+
+  explicit SnapshotReader(std::istream &in, uint8_t *mapping = nullptr)
+    : in{in}, mapping{mapping}, size{input_size(in)} {}
+
+  auto read_bytes(void *data, std::size_t size) -> void {
+    in.read(static_cast<char *>(data), static_cast<std::streamsize>(size));
+    offset += size;
+  }
+
+  template <typename T>
+  [[nodiscard]] auto read_value() -> T {
+    auto value = T{};
+    read_bytes(&value, sizeof(T));
+    return value;
+  }
+
+  auto skip(std::size_t size) -> void {
+    in.ignore(static_cast<std::streamsize>(size));
+    if (std::cmp_not_equal(in.gcount(), size)) {
+      in.setstate(std::ios::failbit);
+    }
+    offset += size;
+  }
+
+  // fails the stream if the rest of the input is shorter than `size` bytes
+  [[nodiscard]] auto has_bytes(std::size_t size) -> bool {
+    if (offset > this->size || size > this->size - offset) {
+      in.setstate(std::ios::failbit);
+    }
+    return not in.fail();
+  }
+
+  // reads the count of the items that follow, 0 and a failed stream if they can't fit in the rest of the input
+  // `min_size` is the fewest bytes an item is written with
+  [[nodiscard]] auto read_count(std::size_t min_size) -> std::size_t {
+    const auto count = read_value<uint64_t>();
+    if (not in || (count != 0 && not has_bytes(count > this->size / min_size ? this->size + 1 : count * min_size))) {
+      return 0;
+    }
+    return static_cast<std::size_t>(count);
+  }
+
+  [[nodiscard]] auto read_entities() -> std::vector<uint64_t> {
+    auto ids = std::vector<uint64_t>(read_count(sizeof(uint64_t)));
+    read_bytes(ids.data(), ids.size() * sizeof(uint64_t));
+    return ids;
+  }
+
+  // constructs one component written by `write_component` at `ptr`
+  auto read_component(const RegisteredComponent &component, void *ptr) -> void {
+    if (component.trivially_copyable) {
+      read_bytes(ptr, component.info.size);
+    } else {
+      auto bytes = std::string(read_count(1), '\0');
+      read_bytes(bytes.data(), bytes.size());
+      auto block = std::istringstream{std::move(bytes)};
+      component.fn_load(block, ptr);
+    }
+  }
+
+  auto skip_component(const RegisteredComponent &component) -> void {
+    skip(component.trivially_copyable ? component.info.size : read_value<uint64_t>());
+  }
+
+  // appends `n` components to `column`
+  auto read_column(ComponentArray &column, const RegisteredComponent &component, std::size_t n) -> void {
+    const auto begin = column.count;
+
+    // enabled bits, applied once the rows exist
+    auto enabled_bits = std::vector<uint64_t>{};
+    if (read_value<uint64_t>() != 0) {
+      enabled_bits.resize((n + 63) / 64);
+      read_bytes(enabled_bits.data(), enabled_bits.size() * sizeof(uint64_t));
+    }
+
+    // components
+    const auto size = n * column.each_size;
+    const auto mapped = not compressed && is_mapped_column(component, size);
+    if (mapped) {
+      skip((mapped_page_size - offset % mapped_page_size) % mapped_page_size);
+    }
+    if (component.trivially_copyable && not compressed && not has_bytes(size)) {
+      return;
+    }
+
+    if (mapping != nullptr && mapped && column.count == 0) {
+      column.array.borrow(mapping + offset, size);
+      column.count = n;
+      skip(size);
+    } else {
+      column.push_uninitialized(n);
+      if (component.trivially_copyable && compressed) {
+        auto block = std::string(read_count(1), '\0');
+        read_bytes(block.data(), block.size());
+        if (not in || not decode_column(block, column.array.data() + begin * column.each_size, column.each_size, n)) {
+          in.setstate(std::ios::failbit);
+        }
+      } else if (component.trivially_copyable) {
+        read_bytes(column.array.data() + begin * column.each_size, size);
+      } else {
+        assert(component.fn_load);
+        auto bytes = std::string(read_count(1), '\0');
+        read_bytes(bytes.data(), bytes.size());
+        auto block = std::istringstream{std::move(bytes)};
+        for (auto i = begin; i < begin + n; ++i) {
+          component.fn_load(block, column.get_at({i}).data());
+        }
+      }
+    }
+
+    for (auto i = std::size_t{}; i < enabled_bits.size() * 64 && i < n; ++i) {
+      if ((enabled_bits[i / 64] >> (i % 64) & 1) == 0) {
+        column.set_enabled({begin + i}, false);
+      }
+    }
+  }
+};
+
+// Components referenced by a snapshot or a delta.
+// They are written by name once and referred to by index.
+struct ComponentTable {
+  std::unordered_map<ComponentId, uint64_t> indices;
+  std::vector<RegisteredComponent *> components;
+  ComponentRegistry *registry = &component_registry();
+
+  auto add(ComponentId id) -> uint64_t {
+    auto [it, inserted] = indices.try_emplace(id, components.size());
+    if (inserted) {
+      components.push_back(&registry->components.at(id));
+    }
+    return it->second;
+  }
+
+  // like `add` but returns nullopt for a component that isn't registered
+  [[nodiscard]] auto try_add(ComponentId id) -> std::optional<uint64_t> {
+    if (not indices.contains(id) && registry->find(id) == nullptr) {
+      return std::nullopt;
+    }
+    return add(id);
+  }
+
+  auto write(SnapshotWriter &writer) const -> void {
+    writer.write_value(uint64_t{components.size()});
+    for (const auto component : components) {
+      writer.write_value(uint64_t{component->name.size()});
+      writer.write_bytes(component->name.data(), component->name.size());
+      writer.write_value(uint64_t{component->info.size});
+    }
+  }
+
+  // finds the ids of this run by name, returns false for unknown components
+  [[nodiscard]] auto read(SnapshotReader &reader) -> bool {
+    components.resize(reader.read_count(2 * sizeof(uint64_t)));
+    for (auto &component : components) {
+      auto name = std::string(reader.read_count(1), '\0');
+      reader.read_bytes(name.data(), name.size());
+      const auto size = reader.read_value<uint64_t>();
+
+      component = registry->find(name);
+      if (not reader.in || component == nullptr || component->info.size != size) {
+        return false;
+      }
+    }
+    return not reader.in.fail();
+  }
+
+  // reads the index of a component, nullptr and a failed stream if it is not in the table
+  [[nodiscard]] auto read_index(SnapshotReader &reader) const -> RegisteredComponent * {
+    const auto index = reader.read_value<uint64_t>();
+    if (not reader.in || index >= components.size()) {
+      reader.in.setstate(std::ios::failbit);
+      return nullptr;
+    }
+    return components[index];
+  }
+};
+
+// raw bytes of trivially copyable components, serialized bytes of the others
+[[nodiscard]] auto component_bytes(const RegisteredComponent &component, const void *ptr, std::string &scratch)
+  -> std::span<const uint8_t> {
+  if (component.trivially_copyable) {
+    return {static_cast<const uint8_t *>(ptr), component.info.size};
+  }
+
+  auto block = std::ostringstream{};
+  component.fn_save(block, ptr);
+  scratch = std::move(block).str();
+  return {reinterpret_cast<const uint8_t *>(scratch.data()), scratch.size()};
+}
+
+// shared values of an archetype: their count, then the component index and the value of each
+auto write_shared_values(SnapshotWriter &writer, ComponentTable &component_table, const Archetype &arch) -> void {
+  auto scratch = std::string{};
+  writer.write_value(uint64_t{arch.shared_values.size()});
+  for (const auto &shared_value : arch.shared_values) {
+    const auto index = component_table.add(shared_value.id);
+    const auto &component = *component_table.components[index];
+    writer.write_value(index);
+    writer.write_component(component, component_bytes(component, shared_value.value, scratch));
+  }
+}
+
+[[nodiscard]] auto read_shared_values(SnapshotReader &reader, const ComponentTable &component_table,
+                                      ArchetypeStorage &arch_storage) -> std::vector<SharedValue> {
+  auto shared_values = std::vector<SharedValue>(reader.read_count(sizeof(uint64_t)));
+  auto value = ByteArray{};
+  for (auto &shared_value : shared_values) {
+    const auto component = component_table.read_index(reader);
+    if (component == nullptr || not component->info.shared) {
+      reader.in.setstate(std::ios::failbit);
+      return {};
+    }
+    value.resize(component->info.size);
+    reader.read_component(*component, value.data());
+    shared_value = arch_storage.intern_shared_value(component->info, value.data());
+  }
+
+  // ids of this run can be in another order
+  std::ranges::sort(shared_values, std::ranges::less(), &SharedValue::id);
+  return shared_values;
+}
+
+// bytes of the shared values of an archetype, for comparing signatures across snapshots
+[[nodiscard]] auto shared_value_bytes(const Archetype &arch) -> std::vector<std::vector<uint8_t>> {
+  auto &registry = component_registry();
+  auto scratch = std::string{};
+  auto values = std::vector<std::vector<uint8_t>>{};
+  for (const auto &shared_value : arch.shared_values) {
+    const auto bytes = component_bytes(registry.components.at(shared_value.id), shared_value.value, scratch);
+    values.emplace_back(bytes.begin(), bytes.end());
+  }
+  return values;
+}
+
+[[nodiscard]] auto capture_column(const ComponentArray &column, RegisteredComponent &component) -> Snapshot::Column {
+  auto captured = Snapshot::Column{};
+  captured.component = &component;
+
+  if (component.trivially_copyable) {
+    captured.bytes.assign(column.array.data(), column.array.data() + column.array.size());
+  } else {
+    auto scratch = std::string{};
+    for (auto i = std::size_t{}; i < column.count; ++i) {
+      const auto bytes = component_bytes(component, column.get_at({i}).data(), scratch);
+      captured.offsets.push_back(captured.bytes.size());
+      captured.bytes.insert(captured.bytes.end(), bytes.begin(), bytes.end());
+    }
+    captured.offsets.push_back(captured.bytes.size());
+  }
+
+  if (column.disabled_count != 0) {
+    captured.enabled_bits.assign(column.enabled_bits.begin(), column.enabled_bits.end());
+  }
+  return captured;
+}
+
+// istream over a mapped snapshot, seekable so reads are bounded by the size of the mapping
+struct MemoryBuffer : std::streambuf {
+  MemoryBuffer(uint8_t *data, std::size_t size) {
+    auto begin = reinterpret_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  }
+
+  auto seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode) -> pos_type override {
+    const auto base = dir == std::ios::beg ? eback() : dir == std::ios::cur ? gptr() : egptr();
+    if (off < eback() - base || off > egptr() - base) {
+      return pos_type(off_type(-1));
+    }
+    setg(eback(), base + off, egptr());
+    return gptr() - eback();
+  }
+
+  auto seekpos(pos_type pos, std::ios::openmode which) -> pos_type override {
+    return seekoff(off_type(pos), std::ios::beg, which);
+  }
+};
+
+// maps a file copy on write, the mapping is released with the returned pointer
+[[nodiscard]] auto map_file(const std::filesystem::path &path, std::size_t &size) -> std::shared_ptr<void> {
+#ifdef _WIN32
+  auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+
+  auto file_size = LARGE_INTEGER{};
+  GetFileSizeEx(file, &file_size);
+  size = static_cast<std::size_t>(file_size.QuadPart);
+
+  auto mapping = CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+
+  auto ptr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+
+  return {ptr, [](void *ptr) {
+            UnmapViewOfFile(ptr);
+          }};
+#else
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  size = static_cast<std::size_t>(st.st_size);
+
+  auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+
+  return {ptr, [size](void *ptr) {
+            munmap(ptr, size);
+          }};
+#endif
+}
+
+// FNV-1a, finds batches that were only partly written
+[[nodiscard]] auto checksum(std::string_view bytes) -> uint64_t {
+  auto hash = uint64_t{0xcbf29ce484222325};
+  for (const auto c : bytes) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+// reads the next batch of a command log, nullopt at the end of the log or at a torn batch
+[[nodiscard]] auto read_log_batch(SnapshotReader &reader) -> std::optional<std::string> {
+  const auto size = reader.read_value<uint64_t>();
+  const auto hash = reader.read_value<uint64_t>();
+  if (not reader.in) {
+    return std::nullopt;
+  }
+
+  auto bytes = std::string(size, '\0');
+  reader.read_bytes(bytes.data(), bytes.size());
+  if (not reader.in || checksum(bytes) != hash) {
+    return std::nullopt;
+  }
+  return bytes;
+}
+
+// rows of an archetype or a sparse set that go in a snapshot, every row if `rows` is empty
+template <typename Table>
+struct SavedTable {
+  Table *table = nullptr;
+  std::vector<std::size_t> rows;
+};
+
+auto write_snapshot(std::ostream &out, bool compress, std::span<const SavedTable<Archetype>> archs,
+                    std::span<const SavedTable<SparseSet>> sets, ComponentRegistry &registry = component_registry(),
+                    uint64_t id_gen = Entity::id_gen.load()) -> void {
+  // components in the snapshot, archetypes and sparse sets refer to them by index
+  auto component_table = ComponentTable{};
+  component_table.registry = &registry;
+  for (const auto &[arch, _] : archs) {
+    for (const auto id : arch->component_ids) {
+      component_table.add(id);
+    }
+  }
+  for (const auto &[sparse_set, _] : sets) {
+    component_table.add(sparse_set->dense.id);
+  }
+
+  auto writer = SnapshotWriter{out};
+  writer.compressed = compress;
+
+  // header
+  writer.write_value(snapshot_magic);
+  writer.write_value(snapshot_version);
+  writer.write_value(compress ? snapshot_compressed : uint64_t{});
+  writer.write_value(id_gen);
+
+  component_table.write(writer);
+
+  // archetypes
+  writer.write_value(uint64_t{archs.size()});
+  for (const auto &[arch, rows] : archs) {
+    writer.write_value(uint64_t{arch->component_ids.size()});
+    for (const auto id : arch->component_ids) {
+      writer.write_value(component_table.add(id));
+    }
+    write_shared_values(writer, component_table, *arch);
+
+    writer.write_entities(arch->entities, rows);
+    for (const auto &column : arch->components) {
+      writer.write_column(column, *component_table.components[component_table.add(column.id)], rows);
+    }
+  }
+
+  // sparse sets
+  writer.write_value(uint64_t{sets.size()});
+  for (const auto &[sparse_set, rows] : sets) {
+    const auto index = component_table.add(sparse_set->dense.id);
+    writer.write_value(index);
+    writer.write_entities(sparse_set->entities, rows);
+    writer.write_column(sparse_set->dense, *component_table.components[index], rows);
+  }
+}
+
+// every entity of the storage
+auto save_storage(ArchetypeStorage &arch_storage, std::ostream &out, bool compress,
+                  ComponentRegistry &registry = component_registry(), uint64_t id_gen = Entity::id_gen.load()) -> void {
+  auto archs = std::vector<SavedTable<Archetype>>{};
+  for (const auto arch : arch_storage.archetypes) {
+    if (arch != nullptr && not arch->entities.empty()) {
+      archs.push_back({arch, {}});
+    }
+  }
+
+  auto sets = std::vector<SavedTable<SparseSet>>{};
+  for (auto &[_, sparse_set] : arch_storage.sparse_sets) {
+    if (not sparse_set.entities.empty()) {
+      sets.push_back({&sparse_set, {}});
+    }
+  }
+
+  write_snapshot(out, compress, archs, sets, registry, id_gen);
+}
+
+// sorted components without duplicates, and one value for every shared component of the signature
+[[nodiscard]] auto is_valid_signature(const std::vector<ComponentInfo> &infos,
+                                      const std::vector<SharedValue> &shared_values) -> bool {
+  const auto shared_count = std::ranges::count_if(infos, &ComponentInfo::shared);
+  return std::ranges::adjacent_find(infos, std::ranges::equal_to(), &ComponentInfo::id) == infos.end() &&
+         std::cmp_equal(shared_count, shared_values.size()) &&
+         std::ranges::adjacent_find(shared_values, std::ranges::equal_to(), &SharedValue::id) == shared_values.end() &&
+         std::ranges::all_of(shared_values, [&](const SharedValue &shared_value) {
+           return std::ranges::binary_search(infos, shared_value.id, std::ranges::less(), &ComponentInfo::id);
+         });
+}
+
+// reads a snapshot into an empty storage, the entities keep their saved ids
+// a snapshot that is cut short or doesn't fit together returns false and leaves `staging` to be thrown away
+[[nodiscard]] auto load_snapshot(ArchetypeStorage &staging, SnapshotReader &reader, uint64_t &saved_id_gen) -> bool {
+  assert(staging.entity_locations.empty());
+
+  // header
+  if (reader.read_value<uint64_t>() != snapshot_magic) {
+    return false;
+  }
+  if (reader.read_value<uint64_t>() != snapshot_version) {
+    return false;
+  }
+  const auto flags = reader.read_value<uint64_t>();
+  if ((flags & ~snapshot_compressed) != 0) {
+    return false;
+  }
+  reader.compressed = (flags & snapshot_compressed) != 0;
+  saved_id_gen = reader.read_value<uint64_t>();
+
+  // components, the ids of this run are found by name
+  auto component_table = ComponentTable{};
+  if (not component_table.read(reader)) {
+    return false;
+  }
+
+  // archetypes, each one has at least its component count, shared value count and entity count
+  for (auto n = reader.read_count(3 * sizeof(uint64_t)); n != 0 && reader.in; --n) {
+    auto arch_components = std::vector<RegisteredComponent *>(reader.read_count(sizeof(uint64_t)));
+    auto infos = std::vector<ComponentInfo>{};
+    for (auto &component : arch_components) {
+      component = component_table.read_index(reader);
+      if (component == nullptr) {
+        return false;
+      }
+      infos.push_back(component->info);
+    }
+    std::ranges::sort(infos, std::ranges::less(), &ComponentInfo::id);
+    const auto shared_values = read_shared_values(reader, component_table, staging);
+
+    if (not reader.in || not is_valid_signature(infos, shared_values)) {
+      return false;
+    }
+    auto arch = staging.find_or_create_archetype(infos, shared_values);
+
+    // whole tables are appended at once
+    const auto ids = reader.read_entities();
+    const auto begin = arch->entities.size();
+    arch->entities.reserve(begin + ids.size());
+    for (auto i = std::size_t{}; i < ids.size(); ++i) {
+      // ids come from the saved generator and are unique
+      const auto entity = Entity{.id = {ids[i]}, .arch_storage = &staging};
+      if (ids[i] == 0 || ids[i] > saved_id_gen ||
+          not staging.entity_locations.try_emplace(entity, arch, EntityIndex{begin + i}).second) {
+        return false;
+      }
+      arch->entities.push_back(entity);
+    }
+
+    // columns were written in the order of the saved signature
+    for (const auto component : arch_components) {
+      if (component->info.has_column()) {
+        reader.read_column(*arch->find_column(component->info.id), *component, ids.size());
+      }
+    }
+  }
+
+  // sparse sets, of the entities in the archetypes
+  for (auto n = reader.read_count(2 * sizeof(uint64_t)); n != 0 && reader.in; --n) {
+    const auto component = component_table.read_index(reader);
+    if (component == nullptr || not component->sparse) {
+      return false;
+    }
+    auto &sparse_set =
+      staging.sparse_sets.try_emplace(component->info.id, component->info, staging.resource).first->second;
+
+    const auto ids = reader.read_entities();
+    const auto begin = sparse_set.entities.size();
+    reader.read_column(sparse_set.dense, *component, ids.size());
+    if (sparse_set.dense.count != begin + ids.size()) {
+      return false;
+    }
+    for (const auto id : ids) {
+      const auto entity = Entity{.id = {id}, .arch_storage = &staging};
+      if (not staging.entity_locations.contains(entity) || sparse_set.contains(entity)) {
+        return false;
+      }
+      sparse_set.link(entity);
+    }
+  }
+
+  return not reader.in.fail();
+}
+
+// Component values of a delta, read before anything is applied and moved out by memcpy once the delta parsed.
+struct StagedValues {
+  struct Value {
+    uint64_t id = 0;
+    RegisteredComponent *component = nullptr;
+    bool enabled = true;
+    std::size_t row = 0;
+    bool taken = false;
+  };
+
+  std::unordered_map<ComponentId, ComponentArray> columns;
+  std::vector<Value> values;
+
+  StagedValues() = default;
+  StagedValues(const StagedValues &) = delete;
+  auto operator=(const StagedValues &) -> StagedValues & = delete;
+
+  // values that weren't taken are destroyed
+  ~StagedValues() {
+    for (const auto &value : values) {
+      auto &column = columns.at(value.component->info.id);
+      if (not value.taken && column.each_size != 0) {
+        column.fn_destructor(column.get_at({value.row}).data());
+      }
+    }
+  }
+
+  auto read(SnapshotReader &reader, uint64_t id, RegisteredComponent *component) -> void {
+    auto &column = columns.try_emplace(component->info.id, component->info).first->second;
+    const auto enabled = reader.read_value<uint8_t>() != 0;
+    column.push_uninitialized();
+    reader.read_component(*component, column.get_last().data());
+    values.push_back({id, component, enabled, column.count - 1});
+  }
+
+  // `ptr` must not hold a component
+  auto take(Value &value, void *ptr) -> void {
+    assert(not value.taken);
+    const auto &column = columns.at(value.component->info.id);
+    std::memcpy(ptr, column.get_at({value.row}).data(), column.each_size);
+    value.taken = true;
+  }
+};
+
+} // namespace
+
+auto ComponentRegistry::add(RegisteredComponent component) -> void {
+  assert(not names.contains(component.name) || names.at(component.name) == component.info.id);
+
+  names.insert_or_assign(component.name, component.info.id);
+  components.insert_or_assign(component.info.id, std::move(component));
+}
+
+[[nodiscard]] auto ComponentRegistry::find(ComponentId id) -> RegisteredComponent * {
+  auto it = components.find(id);
+  return it != components.end() ? &it->second : nullptr;
+}
+
+[[nodiscard]] auto ComponentRegistry::find(const std::string &name) -> RegisteredComponent * {
+  auto it = names.find(name);
+  return it != names.end() ? find(it->second) : nullptr;
+}
+
+[[nodiscard]] auto component_registry() -> ComponentRegistry & {
+  static auto registry = ComponentRegistry{};
+  return registry;
+}
+
+auto ArchetypeStorage::save(std::ostream &out, bool compress) -> void {
+  save_storage(*this, out, compress);
+}
+
+auto ArchetypeStorage::save_partition(Query &query, std::ostream &out, bool compress) -> void {
+  // rows of the matched entities, grouped by archetype
+  auto matched = std::vector<std::pair<Archetype *, std::size_t>>{};
+  auto selected = std::unordered_set<Entity>{};
+  query.start();
+  for (auto entity = query.get_next_entity(nullptr); entity.arch != nullptr; entity = query.get_next_entity(nullptr)) {
+    matched.emplace_back(entity.arch, entity.index.i);
+    selected.insert({entity.id, this});
+  }
+  // by archetype id so the bytes don't depend on where the archetypes were allocated
+  std::ranges::sort(matched, std::ranges::less(), [](const auto &row) {
+    return std::pair{row.first->id.value, row.second};
+  });
+
+  auto archs = std::vector<SavedTable<Archetype>>{};
+  for (const auto &[arch, row] : matched) {
+    if (archs.empty() || archs.back().table != arch) {
+      archs.push_back({arch, {}});
+    }
+    archs.back().rows.push_back(row);
+  }
+
+  // the sparse components of the matched entities
+  auto sets = std::vector<SavedTable<SparseSet>>{};
+  for (auto &[_, sparse_set] : sparse_sets) {
+    auto saved = SavedTable<SparseSet>{&sparse_set, {}};
+    for (auto i = std::size_t{}; i < sparse_set.entities.size(); ++i) {
+      if (selected.contains(sparse_set.entities[i])) {
+        saved.rows.push_back(i);
+      }
+    }
+    if (not saved.rows.empty()) {
+      sets.push_back(std::move(saved));
+    }
+  }
+
+  write_snapshot(out, compress, archs, sets);
+}
+
+auto ArchetypeStorage::load_partition(std::istream &in, std::unordered_map<EntityId, Entity> *remapped_ids) -> bool {
+  auto staging = ArchetypeStorage{resource};
+  auto reader = SnapshotReader{in};
+  auto saved_id_gen = uint64_t{};
+  if (not load_snapshot(staging, reader, saved_id_gen)) {
+    return false;
+  }
+
+  merge(std::move(staging), remapped_ids, true);
+  return true;
+}
+
+auto ArchetypeStorage::load(std::istream &in) -> bool {
+  auto staging = ArchetypeStorage{resource};
+  auto reader = SnapshotReader{in};
+  auto saved_id_gen = uint64_t{};
+  if (not load_snapshot(staging, reader, saved_id_gen)) {
+    return false;
+  }
+
+  // nothing borrows from the old mappings after the entities are replaced
+  delete_all_archetypes();
+  mapped_snapshots.clear();
+  merge(std::move(staging));
+  Entity::id_gen = std::max<std::size_t>(Entity::id_gen, saved_id_gen);
+  return true;
+}
+
+auto ArchetypeStorage::map_snapshot(const std::filesystem::path &path) -> bool {
+  auto size = std::size_t{};
+  auto mapping = map_file(path, size);
+  if (mapping == nullptr) {
+    return false;
+  }
+
+  auto buffer = MemoryBuffer{static_cast<uint8_t *>(mapping.get()), size};
+  auto in = std::istream{&buffer};
+  auto reader = SnapshotReader{in, static_cast<uint8_t *>(mapping.get())};
+
+  // the mapping is owned by the storage whose columns borrow from it, so a failed load
+  // frees the borrowing columns before the file is unmapped and a successful one moves it with them
+  auto staging = ArchetypeStorage{resource};
+  staging.mapped_snapshots.push_back(mapping);
+  auto saved_id_gen = uint64_t{};
+  if (not load_snapshot(staging, reader, saved_id_gen)) {
+    return false;
+  }
+
+  delete_all_archetypes();
+  mapped_snapshots.clear();
+  merge(std::move(staging));
+  Entity::id_gen = std::max<std::size_t>(Entity::id_gen, saved_id_gen);
+  return true;
+}
+
+[[nodiscard]] auto Snapshot::Column::row(std::size_t index) const -> std::span<const uint8_t> {
+  if (offsets.empty()) {
+    const auto size = component->info.size;
+    return {bytes.data() + index * size, size};
+  }
+  return {bytes.data() + offsets[index], offsets[index + 1] - offsets[index]};
+}
+
+[[nodiscard]] auto Snapshot::Column::is_enabled(std::size_t index) const -> bool {
+  return enabled_bits.empty() || (enabled_bits[index / 64] >> (index % 64) & 1) != 0;
+}
+
+[[nodiscard]] auto ArchetypeStorage::snapshot() -> Snapshot {
+  auto &registry = component_registry();
+  auto snapshot = Snapshot{};
+
+  for (auto arch : archetypes) {
+    if (arch == nullptr || arch->entities.empty()) {
+      continue;
+    }
+
+    auto &table = snapshot.tables.emplace_back();
+    table.component_ids.assign(arch->component_ids.begin(), arch->component_ids.end());
+    table.shared_values = shared_value_bytes(*arch);
+    for (auto i = std::size_t{}; i < arch->entities.size(); ++i) {
+      const auto id = arch->entities[i].id.value;
+      table.entities.push_back(id);
+      table.rows.emplace(id, i);
+      snapshot.locations.emplace(id, snapshot.tables.size() - 1);
+    }
+    for (auto &column : arch->components) {
+      table.columns.push_back(capture_column(column, registry.components.at(column.id)));
+    }
+  }
+
+  for (auto &[id, sparse_set] : sparse_sets) {
+    if (sparse_set.entities.empty()) {
+      continue;
+    }
+
+    auto &table = snapshot.sparse_tables[id];
+    table.component_ids.push_back(id);
+    for (auto i = std::size_t{}; i < sparse_set.entities.size(); ++i) {
+      table.entities.push_back(sparse_set.entities[i].id.value);
+      table.rows.emplace(sparse_set.entities[i].id.value, i);
+    }
+    table.columns.push_back(capture_column(sparse_set.dense, registry.components.at(id)));
+  }
+
+  return snapshot;
+}
+
+auto ArchetypeStorage::diff(const Snapshot &prev, std::ostream &out) -> void {
+  auto &registry = component_registry();
+  auto component_table = ComponentTable{};
+  auto scratch = std::string{};
+
+  // every section is counted while it is written
+  auto destroyed_out = std::ostringstream{};
+  auto moved_out = std::ostringstream{};
+  auto changed_out = std::ostringstream{};
+  auto sparse_changed_out = std::ostringstream{};
+  auto sparse_removed_out = std::ostringstream{};
+  auto destroyed = SnapshotWriter{destroyed_out};
+  auto moved = SnapshotWriter{moved_out};
+  auto changed = SnapshotWriter{changed_out};
+  auto sparse_changed = SnapshotWriter{sparse_changed_out};
+  auto sparse_removed = SnapshotWriter{sparse_removed_out};
+  auto destroyed_count = uint64_t{};
+  auto moved_count = uint64_t{};
+  auto changed_count = uint64_t{};
+  auto sparse_changed_count = uint64_t{};
+  auto sparse_removed_count = uint64_t{};
+
+  const auto is_alive = [&](uint64_t id) {
+    return entity_locations.contains({.id = {id}, .arch_storage = this});
+  };
+
+  // destroyed entities
+  for (const auto &[id, _] : prev.locations) {
+    if (not is_alive(id)) {
+      destroyed.write_value(id);
+      destroyed_count += 1;
+    }
+  }
+
+  for (auto arch : archetypes) {
+    if (arch == nullptr) {
+      continue;
+    }
+
+    auto components = std::vector<RegisteredComponent *>{};
+    for (const auto &column : arch->components) {
+      components.push_back(&registry.components.at(column.id));
+    }
+    const auto shared_values = shared_value_bytes(*arch);
+
+    for (auto i = std::size_t{}; i < arch->entities.size(); ++i) {
+      const auto id = arch->entities[i].id.value;
+      const auto location = prev.locations.find(id);
+      const auto table = location != prev.locations.end() ? &prev.tables[location->second] : nullptr;
+
+      if (table == nullptr || not std::ranges::equal(table->component_ids, arch->component_ids) ||
+          table->shared_values != shared_values) {
+        // created or moved to another archetype, the whole row is written
+        moved.write_value(id);
+        moved.write_value(uint64_t{arch->component_ids.size()});
+        for (const auto component_id : arch->component_ids) {
+          moved.write_value(component_table.add(component_id));
+        }
+        write_shared_values(moved, component_table, *arch);
+        for (auto j = std::size_t{}; j < arch->components.size(); ++j) {
+          const auto &column = arch->components[j];
+          moved.write_value(uint8_t{column.is_enabled({i})});
+          moved.write_component(*components[j], component_bytes(*components[j], column.get_at({i}).data(), scratch));
+        }
+        moved_count += 1;
+        continue;
+      }
+
+      // changed components
+      const auto row = table->rows.at(id);
+      for (auto j = std::size_t{}; j < arch->components.size(); ++j) {
+        const auto &column = arch->components[j];
+        const auto bytes = component_bytes(*components[j], column.get_at({i}).data(), scratch);
+        const auto enabled = column.is_enabled({i});
+        if (enabled != table->columns[j].is_enabled(row) || not std::ranges::equal(bytes, table->columns[j].row(row))) {
+          changed.write_value(id);
+          changed.write_value(component_table.add(column.id));
+          changed.write_value(uint8_t{enabled});
+          changed.write_component(*components[j], bytes);
+          changed_count += 1;
+        }
+      }
+    }
+  }
+
+  // added or changed sparse components
+  for (auto &[component_id, sparse_set] : sparse_sets) {
+    auto &component = registry.components.at(component_id);
+    const auto it = prev.sparse_tables.find(component_id);
+    const auto table = it != prev.sparse_tables.end() ? &it->second : nullptr;
+
+    for (auto i = std::size_t{}; i < sparse_set.entities.size(); ++i) {
+      const auto id = sparse_set.entities[i].id.value;
+      const auto bytes = component_bytes(component, std::as_const(sparse_set.dense).get_at({i}).data(), scratch);
+      const auto enabled = sparse_set.dense.is_enabled({i});
+
+      if (table != nullptr) {
+        if (const auto row = table->rows.find(id); row != table->rows.end() &&
+                                                   enabled == table->columns[0].is_enabled(row->second) &&
+                                                   std::ranges::equal(bytes, table->columns[0].row(row->second))) {
+          continue;
+        }
+      }
+
+      sparse_changed.write_value(component_table.add(component_id));
+      sparse_changed.write_value(id);
+      sparse_changed.write_value(uint8_t{enabled});
+      sparse_changed.write_component(component, bytes);
+      sparse_changed_count += 1;
+    }
+  }
+
+  // removed sparse components of entities that still exist
+  for (const auto &[component_id, table] : prev.sparse_tables) {
+    const auto it = sparse_sets.find(component_id);
+    for (const auto id : table.entities) {
+      if (is_alive(id) && (it == sparse_sets.end() || not it->second.contains({.id = {id}, .arch_storage = this}))) {
+        sparse_removed.write_value(component_table.add(component_id));
+        sparse_removed.write_value(id);
+        sparse_removed_count += 1;
+      }
+    }
+  }
+
+  auto writer = SnapshotWriter{out};
+  writer.write_value(delta_magic);
+  writer.write_value(delta_version);
+  writer.write_value(uint64_t{Entity::id_gen.load()});
+  component_table.write(writer);
+
+  const auto write_section = [&](uint64_t count, std::ostringstream &section) {
+    const auto bytes = std::move(section).str();
+    writer.write_value(count);
+    writer.write_bytes(bytes.data(), bytes.size());
+  };
+  write_section(destroyed_count, destroyed_out);
+  write_section(moved_count, moved_out);
+  write_section(changed_count, changed_out);
+  write_section(sparse_changed_count, sparse_changed_out);
+  write_section(sparse_removed_count, sparse_removed_out);
+}
+
+auto ArchetypeStorage::apply_delta(std::istream &in) -> bool {
+  auto reader = SnapshotReader{in};
+
+  // header
+  if (reader.read_value<uint64_t>() != delta_magic || reader.read_value<uint64_t>() != delta_version) {
+    return false;
+  }
+  const auto saved_id_gen = reader.read_value<uint64_t>();
+
+  auto component_table = ComponentTable{};
+  if (not component_table.read(reader)) {
+    return false;
+  }
+
+  // the whole delta is read before the storage changes, a delta that fails to parse changes nothing
+
+  // destroyed entities
+  auto destroyed = std::vector<uint64_t>(reader.read_count(sizeof(uint64_t)));
+  for (auto &id : destroyed) {
+    id = reader.read_value<uint64_t>();
+  }
+
+  // created entities and entities that changed archetype, their rows are staged like a loaded snapshot
+  auto staging = ArchetypeStorage{resource};
+  for (auto n = reader.read_count(sizeof(uint64_t)); n != 0 && reader.in; --n) {
+    const auto id = reader.read_value<uint64_t>();
+    auto arch_components = std::vector<RegisteredComponent *>(reader.read_count(sizeof(uint64_t)));
+    auto infos = std::vector<ComponentInfo>{};
+    for (auto &component : arch_components) {
+      component = component_table.read_index(reader);
+      if (component == nullptr) {
+        return false;
+      }
+      infos.push_back(component->info);
+    }
+    std::ranges::sort(infos, std::ranges::less(), &ComponentInfo::id);
+    const auto shared_values = read_shared_values(reader, component_table, staging);
+    if (not reader.in || not is_valid_signature(infos, shared_values)) {
+      return false;
+    }
+    auto arch = staging.find_or_create_archetype(infos, shared_values);
+
+    const auto entity = Entity{.id = {id}, .arch_storage = &staging};
+    if (id == 0 || id > saved_id_gen || staging.entity_locations.contains(entity)) {
+      return false;
+    }
+    const auto index = arch->add_entity(entity);
+    staging.entity_locations.try_emplace(entity, arch, index);
+
+    for (const auto component : arch_components) {
+      if (component->info.has_column()) {
+        auto column = arch->find_column(component->info.id);
+        const auto enabled = reader.read_value<uint8_t>() != 0;
+        reader.read_component(*component, column->get_at(index).data());
+        column->set_enabled(index, enabled);
+      }
+    }
+  }
+
+  // changed components
+  auto changed = StagedValues{};
+  for (auto n = reader.read_count(sizeof(uint64_t)); n != 0 && reader.in; --n) {
+    const auto id = reader.read_value<uint64_t>();
+    const auto component = component_table.read_index(reader);
+    if (component == nullptr) {
+      return false;
+    }
+    changed.read(reader, id, component);
+  }
+
+  // added or changed sparse components
+  auto sparse_changed = StagedValues{};
+  for (auto n = reader.read_count(sizeof(uint64_t)); n != 0 && reader.in; --n) {
+    const auto component = component_table.read_index(reader);
+    const auto id = reader.read_value<uint64_t>();
+    if (component == nullptr || not component->sparse) {
+      return false;
+    }
+    sparse_changed.read(reader, id, component);
+  }
+
+  // removed sparse components
+  auto sparse_removed = std::vector<std::pair<RegisteredComponent *, uint64_t>>(reader.read_count(sizeof(uint64_t)));
+  for (auto &[component, id] : sparse_removed) {
+    component = component_table.read_index(reader);
+    id = reader.read_value<uint64_t>();
+    if (component == nullptr) {
+      return false;
+    }
+  }
+
+  if (reader.in.fail()) {
+    return false;
+  }
+
+  // apply
+  Entity::id_gen = std::max<std::size_t>(Entity::id_gen, saved_id_gen);
+
+  for (const auto id : destroyed) {
+    if (const auto entity = Entity{.id = {id}, .arch_storage = this}; entity_locations.contains(entity)) {
+      delete_entity(entity);
+    }
+  }
+
+  // the rows are replaced, sparse components are kept
+  for (const auto &[entity, _] : staging.entity_locations) {
+    if (auto it = entity_locations.find({entity.id, this}); it != entity_locations.end()) {
+      it->second.arch->delete_entity(it->second.index);
+      entity_locations.erase(it);
+    }
+  }
+  merge(std::move(staging));
+
+  for (auto &value : changed.values) {
+    auto it = entity_locations.find({.id = {value.id}, .arch_storage = this});
+    auto column = it != entity_locations.end() ? it->second.arch->find_column(value.component->info.id) : nullptr;
+    if (column == nullptr) {
+      continue;
+    }
+
+    auto ptr = column->get_at(it->second.index).data();
+    value.component->info.fn_destructor(ptr);
+    changed.take(value, ptr);
+    column->set_enabled(it->second.index, value.enabled);
+  }
+
+  for (auto &value : sparse_changed.values) {
+    const auto entity = Entity{.id = {value.id}, .arch_storage = this};
+    if (not entity_locations.contains(entity)) {
+      continue;
+    }
+
+    auto &sparse_set =
+      sparse_sets.try_emplace(value.component->info.id, value.component->info, resource).first->second;
+    auto ptr = sparse_set.get(entity);
+    if (sparse_set.contains(entity)) {
+      value.component->info.fn_destructor(ptr);
+    } else {
+      ptr = sparse_set.insert(entity);
+    }
+    sparse_changed.take(value, ptr);
+    sparse_set.dense.set_enabled({sparse_set.find(entity)}, value.enabled);
+  }
+
+  for (const auto &[component, id] : sparse_removed) {
+    if (auto it = sparse_sets.find(component->info.id); it != sparse_sets.end()) {
+      it->second.erase({.id = {id}, .arch_storage = this});
+    }
+  }
+
+  return true;
+}
+
+CommandLog::CommandLog(const std::filesystem::path &path, std::size_t sync_every) : sync_every{sync_every} {
+  // keep the batches before the first torn one
+  auto valid_size = std::size_t{};
+  if (auto in = std::ifstream{path, std::ios::binary}; in && in.peek() != std::ifstream::traits_type::eof()) {
+    auto reader = SnapshotReader{in};
+    if (reader.read_value<uint64_t>() != log_magic || reader.read_value<uint64_t>() != log_version) {
+      // not a command log, it is left untouched
+      return;
+    }
+
+    valid_size = reader.offset;
+    while (read_log_batch(reader)) {
+      valid_size = reader.offset;
+    }
+    in.close();
+
+    // the log stays closed if the torn batch can't be cut off
+    auto error = std::error_code{};
+    std::filesystem::resize_file(path, valid_size, error);
+    if (error) {
+      return;
+    }
+  }
+
+  file = std::fopen(path.string().c_str(), "ab");
+  if (file != nullptr && valid_size == 0) {
+    if (std::fwrite(&log_magic, sizeof(log_magic), 1, file) != 1 ||
+        std::fwrite(&log_version, sizeof(log_version), 1, file) != 1) {
+      close();
+      return;
+    }
+    sync();
+  }
+}
+
+CommandLog::~CommandLog() {
+  if (file != nullptr) {
+    sync();
+    close();
+  }
+}
+
+auto CommandLog::close() -> void {
+  std::fclose(file);
+  file = nullptr;
+}
+
+auto CommandLog::append(Command &command) -> bool {
+  if (file == nullptr) {
+    return false;
+  }
+
+  // commands refer to components by their index in the batch's table of names
+  auto component_table = ComponentTable{};
+  auto records = std::ostringstream{};
+  auto writer = SnapshotWriter{records};
+  auto scratch = std::string{};
+  auto registered = true;
+  const auto add_component = [&](ComponentId id) {
+    const auto index = component_table.try_add(id);
+    registered = registered && index.has_value();
+    return index.value_or(0);
+  };
+
+  auto &buf = command.aligned_buf;
+  for (auto i = std::size_t{}; i < buf.size();) {
+    const auto type = buf.get<CommandType>(i);
+    writer.write_value(uint64_t{type});
+    switch (type) {
+    case CommandType::CreateEntity:
+      writer.write_value(uint64_t{buf.get<EntityId>(i).value});
+      break;
+    case CommandType::DeleteEntity:
+      writer.write_value(uint64_t{buf.get<Entity>(i).id.value});
+      break;
+    case CommandType::DeleteAll:
+      // includes, excludes, sparse includes, sparse excludes
+      for (auto list = 0; list < 4; ++list) {
+        const auto n = buf.get<std::size_t>(i);
+        writer.write_value(uint64_t{n});
+        for (auto k = n; k != 0; --k) {
+          writer.write_value(add_component(buf.get<ComponentId>(i)));
+        }
+      }
+      break;
+    case CommandType::AddComponent: {
+      const auto entity = buf.get<Entity>(i);
+      const auto info = buf.get<ComponentInfo>(i);
+      const auto component_index = buf.get<std::size_t>(i);
+      i = component_index + info.size;
+
+      const auto index = add_component(info.id);
+      if (not registered) {
+        return false;
+      }
+      const auto &component = *component_table.components[index];
+      writer.write_value(uint64_t{entity.id.value});
+      writer.write_value(index);
+      if (info.size != 0) {
+        writer.write_component(component, component_bytes(component, buf.get_ptr_at(component_index), scratch));
+      }
+    } break;
+    case CommandType::RemoveComponent:
+      writer.write_value(uint64_t{buf.get<Entity>(i).id.value});
+      writer.write_value(add_component(ComponentId{buf.get<std::size_t>(i)}));
+      break;
+    }
+  }
+
+  // nothing is written if a command can't be replayed
+  if (not registered) {
+    return false;
+  }
+
+  // batch: id generator, components and commands
+  auto payload = std::ostringstream{};
+  auto payload_writer = SnapshotWriter{payload};
+  payload_writer.write_value(uint64_t{Entity::id_gen.load()});
+  component_table.write(payload_writer);
+  const auto record_bytes = std::move(records).str();
+  payload_writer.write_bytes(record_bytes.data(), record_bytes.size());
+  const auto bytes = std::move(payload).str();
+
+  // a batch that was only partly written ends the log, so the log is closed
+  const uint64_t header[] = {bytes.size(), checksum(bytes)};
+  if (std::fwrite(header, sizeof(header), 1, file) != 1 ||
+      std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
+    close();
+    return false;
+  }
+
+  // group commit
+  unsynced += 1;
+  return unsynced < sync_every || sync();
+}
+
+auto CommandLog::sync() -> bool {
+  if (file == nullptr) {
+    return false;
+  }
+
+#ifdef _WIN32
+  const auto synced = std::fflush(file) == 0 && _commit(_fileno(file)) == 0;
+#else
+  const auto synced = std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+#endif
+  if (not synced) {
+    close();
+    return false;
+  }
+  unsynced = 0;
+  return true;
+}
+
+auto ArchetypeStorage::replay(std::istream &in) -> std::size_t {
+  auto reader = SnapshotReader{in};
+  if (reader.read_value<uint64_t>() != log_magic || reader.read_value<uint64_t>() != log_version) {
+    return 0;
+  }
+
+  auto batches = std::size_t{};
+  auto component = ByteArray{resource}; // <-- added components are built here before they are moved in
+  for (auto payload = read_log_batch(reader); payload; payload = read_log_batch(reader)) {
+    const auto size = payload->size();
+    auto block = std::istringstream{std::move(*payload)};
+    auto batch = SnapshotReader{block};
+
+    const auto saved_id_gen = batch.read_value<uint64_t>();
+    auto component_table = ComponentTable{};
+    if (not component_table.read(batch)) {
+      break;
+    }
+    Entity::id_gen = std::max<std::size_t>(Entity::id_gen, saved_id_gen);
+
+    for (const auto registered : component_table.components) {
+      if (registered->sparse) {
+        sparse_sets.try_emplace(registered->info.id, registered->info, resource);
+      }
+    }
+
+    const auto read_entity = [&] {
+      return Entity{.id = {batch.read_value<uint64_t>()}, .arch_storage = this};
+    };
+
+    // a batch that doesn't parse stops the replay like a torn one
+    while (batch.offset < size && batch.in) {
+      switch (static_cast<CommandType>(batch.read_value<uint64_t>())) {
+      case CommandType::CreateEntity: {
+        const auto entity = read_entity();
+        if (not entity_locations.contains(entity)) {
+          auto arch = archetypes[0];
+          entity_locations.try_emplace(entity, arch, EntityIndex{arch->entities.size()});
+          arch->entities.push_back(entity);
+        }
+      } break;
+      case CommandType::DeleteEntity: {
+        const auto entity = read_entity();
+        if (entity_locations.contains(entity)) {
+          delete_entity(entity);
+        }
+      } break;
+      case CommandType::DeleteAll: {
+        auto query = Query{this};
+        const auto read_ids = [&](std::vector<ComponentId> &ids) {
+          ids.resize(batch.read_count(sizeof(uint64_t)));
+          for (auto &id : ids) {
+            const auto registered = component_table.read_index(batch);
+            id = registered != nullptr ? registered->info.id : ComponentId{};
+          }
+          std::ranges::sort(ids, std::ranges::less());
+        };
+        const auto read_sparse_sets = [&](std::vector<SparseSet *> &sets) {
+          sets.resize(batch.read_count(sizeof(uint64_t)));
+          for (auto &sparse_set : sets) {
+            const auto registered = component_table.read_index(batch);
+            const auto it = registered != nullptr ? sparse_sets.find(registered->info.id) : sparse_sets.end();
+            if (it == sparse_sets.end()) {
+              batch.in.setstate(std::ios::failbit);
+              return;
+            }
+            sparse_set = &it->second;
+          }
+        };
+        read_ids(query.includes);
+        read_ids(query.excludes);
+        read_sparse_sets(query.sparse_includes);
+        read_sparse_sets(query.sparse_excludes);
+        if (batch.in) {
+          query.delete_all();
+        }
+      } break;
+      case CommandType::AddComponent: {
+        const auto entity = read_entity();
+        const auto registered = component_table.read_index(batch);
+        if (registered == nullptr) {
+          break;
+        }
+        component.resize(std::max<std::size_t>(registered->info.size, 1));
+        if (registered->info.size != 0) {
+          batch.read_component(*registered, component.data());
+        }
+
+        if (entity_locations.contains(entity)) {
+          add_component(entity, registered->info, component.data());
+        } else {
+          registered->info.fn_destructor(component.data());
+        }
+      } break;
+      case CommandType::RemoveComponent: {
+        const auto entity = read_entity();
+        const auto registered = component_table.read_index(batch);
+        if (registered != nullptr && entity_locations.contains(entity)) {
+          remove_component(entity, registered->info.id);
+        }
+      } break;
+      default:
+        batch.in.setstate(std::ios::failbit);
+        break;
+      }
+    }
+    if (not batch.in) {
+      break;
+    }
+    batches += 1;
+  }
+  return batches;
+}
+
+AsyncSnapshotWriter::~AsyncSnapshotWriter() {
+  wait();
+}
+
+auto AsyncSnapshotWriter::start(ArchetypeStorage &arch_storage, std::filesystem::path path, bool compress) -> void {
+  wait();
+
+  // The capture copies every column into `resource`, so the thread shares no memory with the storage and
+  // writes through component pointers taken before `start` don't reach it.
+  // The registry and the id generator are read here, the thread doesn't touch anything the caller can change.
+  auto registry = component_registry();
+  auto capture = arch_storage.clone(&resource, false, [&](ComponentId id, void *dst, const void *src) {
+    // components without a copy constructor go through their registered `save` and `load` on this thread
+    const auto &component = registry.components.at(id);
+    auto bytes = std::stringstream{};
+    component.fn_save(bytes, src);
+    component.fn_load(bytes, dst);
+  });
+  const auto id_gen = uint64_t{Entity::id_gen.load()};
+  thread = std::thread{[capture = std::move(capture), registry = std::move(registry), id_gen, path = std::move(path),
+                        compress, this]() mutable {
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+
+    auto out = std::ofstream{tmp_path, std::ios::binary | std::ios::trunc};
+    save_storage(*capture, out, compress, registry, id_gen);
+    out.close();
+    capture.reset();
+
+    auto error = std::error_code{};
+    if (out) {
+      std::filesystem::rename(tmp_path, path, error);
+    }
+    saved = out && not error;
+  }};
+}
+
+auto AsyncSnapshotWriter::wait() -> bool {
+  if (thread.joinable()) {
+    thread.join();
+  }
+  return saved;
+}
+
+} // namespace ruecs
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "ecs.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <memory_resource>
+#include <ostream>
+#include <span>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace ruecs {
+
+// Snapshots refer to components by a registered name because component ids depend on the order of first use.
+struct RegisteredComponent {
+  std::string name;
+  ComponentInfo info;
+  bool sparse = false;
+  bool trivially_copyable = false; // <-- columns are written as raw bytes
+  std::function<void(std::ostream &out, const void *component)> fn_save;
+  std::function<void(std::istream &in, void *component)> fn_load; // <-- constructs the component in place
+};
+
+struct ComponentRegistry {
+  std::unordered_map<ComponentId, RegisteredComponent> components;
+  std::unordered_map<std::string, ComponentId> names;
+
+  auto add(RegisteredComponent component) -> void;
+
+  [[nodiscard]] auto find(ComponentId id) -> RegisteredComponent *;
+  [[nodiscard]] auto find(const std::string &name) -> RegisteredComponent *;
+};
+
+[[nodiscard]] auto component_registry() -> ComponentRegistry &;
+
+template <typename T>
+  requires std::is_trivially_copyable_v<T>
+auto register_component(std::string name) -> void {
+  auto component = RegisteredComponent{};
+  component.name = std::move(name);
+  component.info = component_info<T>();
+  component.sparse = SparseComponent<T>;
+  component.trivially_copyable = true;
+  component_registry().add(std::move(component));
+}
+
+// components that aren't trivially copyable are written one by one with `save` and read back with `load`
+template <typename T>
+auto register_component(std::string name, std::function<void(std::ostream &out, const T &component)> save,
+                        std::function<T(std::istream &in)> load) -> void {
+  component_registry().add({
+    .name = std::move(name),
+    .info = component_info<T>(),
+    .sparse = SparseComponent<T>,
+    .fn_save =
+      [save = std::move(save)](std::ostream &out, const void *component) {
+        save(out, *static_cast<const T *>(component));
+      },
+    .fn_load =
+      [load = std::move(load)](std::istream &in, void *component) {
+        std::construct_at(static_cast<T *>(component), load(in));
+      },
+  });
+}
+
+// Copy of the registered components of a storage, the base that `ArchetypeStorage::diff` compares against.
+struct Snapshot {
+  struct Column {
+    RegisteredComponent *component = nullptr;
+    std::vector<uint8_t> bytes;
+    std::vector<std::size_t> offsets;   // <-- row starts of serialized components, empty for raw columns
+    std::vector<uint64_t> enabled_bits; // <-- empty while every row is enabled
+
+    [[nodiscard]] auto row(std::size_t index) const -> std::span<const uint8_t>;
+    [[nodiscard]] auto is_enabled(std::size_t index) const -> bool;
+  };
+
+  struct Table {
+    std::vector<ComponentId> component_ids; // <-- sorted, includes tags
+    std::vector<std::vector<uint8_t>> shared_values; // <-- bytes of the shared values, sorted by id
+    std::vector<uint64_t> entities;
+    std::vector<Column> columns;
+    std::unordered_map<uint64_t, std::size_t> rows; // <-- row of each entity
+  };
+
+  std::vector<Table> tables;                           // <-- one per archetype
+  std::unordered_map<uint64_t, std::size_t> locations; // <-- table of each entity
+  std::unordered_map<ComponentId, Table> sparse_tables;
+};
+
+// Append-only log of the commands run on a storage.
+// Point `ArchetypeStorage::command_log` at it and every `Command::run` appends its commands as one batch before
+// running them, `ArchetypeStorage::replay` runs them again on top of the last snapshot.
+// Components are logged by registered name like snapshots, components changed through pointers aren't logged.
+struct CommandLog {
+  std::FILE *file = nullptr;
+  std::size_t sync_every = 1; // <-- batches per fsync, the batches after the last fsync can be lost on a crash
+  std::size_t unsynced = 0;
+
+  // opens the log for appending, a torn batch left at the end by a crash is cut off
+  explicit CommandLog(const std::filesystem::path &path, std::size_t sync_every = 1);
+  CommandLog(const CommandLog &other) = delete;
+  ~CommandLog();
+
+  auto operator=(const CommandLog &other) -> CommandLog & = delete;
+
+  [[nodiscard]] inline auto is_open() const noexcept -> bool {
+    return file != nullptr;
+  }
+
+  // returns false if the batch didn't reach the file, or the disk when it is synced
+  // a log that failed to write is closed and refuses every later batch, so nothing runs that can't be replayed
+  // commands with components that aren't registered are refused without closing the log
+  auto append(Command &command) -> bool;
+
+  // flushes the batches and waits until they are on disk, closes the log if they couldn't be written
+  auto sync() -> bool;
+
+  auto close() -> void;
+};
+
+// Saves snapshots on a background thread.
+// `start` copies the storage, which is all the calling thread pays for, and the copy is saved and freed by the thread.
+// Components without a copy constructor are copied by saving and loading them on the calling thread instead.
+// The snapshot is written next to `path` and renamed over it once complete, so `path` always holds a whole snapshot.
+struct AsyncSnapshotWriter {
+  std::pmr::synchronized_pool_resource resource; // <-- the copies allocate from it, not from the storage's resource
+  std::thread thread;
+  bool saved = true; // <-- result of the last save, read after joining the thread
+
+  AsyncSnapshotWriter() = default;
+  AsyncSnapshotWriter(const AsyncSnapshotWriter &other) = delete;
+  ~AsyncSnapshotWriter();
+
+  auto operator=(const AsyncSnapshotWriter &other) -> AsyncSnapshotWriter & = delete;
+
+  [[nodiscard]] inline auto busy() const noexcept -> bool {
+    return thread.joinable();
+  }
+
+  // waits for the previous save, then captures `arch_storage` and saves it to `path` in the background
+  auto start(ArchetypeStorage &arch_storage, std::filesystem::path path, bool compress = false) -> void;
+
+  // waits for the current save, returns false if it couldn't be written
+  auto wait() -> bool;
+};
+
+} // namespace ruecs
@@ -0,0 +1,442 @@
+#include <rubus-ecs/ecs.hpp>
+#include <rubus-ecs/snapshot.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Round trips of the snapshot, partition, delta and command log formats, and truncated inputs of each.
+
+namespace {
+
+struct Position {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+
+  auto operator==(const Position &other) const -> bool = default;
+};
+
+struct Counter {
+  int32_t value = 0;
+  int32_t flags = 0;
+
+  auto operator==(const Counter &other) const -> bool = default;
+};
+
+struct Name {
+  std::string value;
+
+  auto operator==(const Name &other) const -> bool = default;
+};
+
+struct Frozen {};
+
+// saved like any other component but can't be copied
+struct Owned {
+  std::unique_ptr<int32_t> value;
+};
+
+struct Buff {
+  static constexpr auto sparse_storage = true;
+  float amount = 0;
+
+  auto operator==(const Buff &other) const -> bool = default;
+};
+
+struct Material {
+  static constexpr auto shared_storage = true;
+  int32_t id = 0;
+
+  auto operator==(const Material &other) const -> bool = default;
+};
+
+auto failures = 0;
+
+#define CHECK(...)                                                                                                     \
+  do {                                                                                                                 \
+    if (not(__VA_ARGS__)) {                                                                                            \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__);                                      \
+      failures += 1;                                                                                                   \
+    }                                                                                                                  \
+  } while (false)
+
+auto register_components() -> void {
+  ruecs::register_component<Position>("Position");
+  ruecs::register_component<Counter>("Counter");
+  ruecs::register_component<Frozen>("Frozen");
+  ruecs::register_component<Buff>("Buff");
+  ruecs::register_component<Material>("Material");
+  ruecs::register_component<ruecs::ChildOf>("ChildOf");
+  ruecs::register_component<Owned>(
+    "Owned",
+    [](std::ostream &out, const Owned &owned) {
+      out << *owned.value << ' ';
+    },
+    [](std::istream &in) {
+      auto value = int32_t{};
+      in >> value;
+      return Owned{std::make_unique<int32_t>(value)};
+    });
+  ruecs::register_component<Name>(
+    "Name",
+    [](std::ostream &out, const Name &name) {
+      out << name.value << '\0';
+    },
+    [](std::istream &in) {
+      auto name = Name{};
+      std::getline(in, name.value, '\0');
+      return name;
+    });
+}
+
+// archetypes with runs, ramps and noise in their columns so every lane encoding is used
+auto populate(ruecs::ArchetypeStorage &arch_storage, std::size_t n) -> std::vector<ruecs::Entity> {
+  auto entities = std::vector<ruecs::Entity>{};
+  auto seed = uint32_t{7};
+  const auto noise = [&] {
+    seed = seed * 1664525 + 1013904223;
+    return seed;
+  };
+
+  for (auto i = std::size_t{}; i < n; ++i) {
+    const auto k = static_cast<int32_t>(i);
+    auto entity = arch_storage.create_entity(Position{static_cast<float>(k), 1.0f, static_cast<float>(noise() % 1000)},
+                                             Counter{k, 3});
+    if (i % 3 == 0) {
+      entity.add_component<Name>(Name{"entity " + std::to_string(i) + " with a name longer than small strings"});
+    }
+    if (i % 4 == 0) {
+      entity.add_component<Frozen>();
+    }
+    if (i % 5 == 0) {
+      entity.add_component<Buff>(Buff{static_cast<float>(noise() % 100)});
+    }
+    if (i % 2 == 0) {
+      entity.add_component<Material>(Material{k % 6});
+    }
+    if (i % 7 == 0) {
+      entity.set_enabled<Position>(false);
+    }
+    if (i != 0 && i % 8 == 0) {
+      entity.add_component<ruecs::ChildOf>(ruecs::ChildOf{entities[i / 8].id});
+    }
+    entities.push_back(entity);
+  }
+  return entities;
+}
+
+template <typename T>
+auto same_component(ruecs::Entity a, ruecs::Entity b) -> bool {
+  const auto x = a.try_get<T>();
+  const auto y = b.try_get<T>();
+  return x == nullptr ? y == nullptr : y != nullptr && *x == *y;
+}
+
+// every entity of `expected` is in `actual` with the same components, `ids` maps the ids that changed
+auto same_entities(ruecs::ArchetypeStorage &expected, ruecs::ArchetypeStorage &actual,
+                   const std::unordered_map<ruecs::EntityId, ruecs::Entity> &ids = {}) -> bool {
+  const auto actual_id = [&](ruecs::EntityId id) {
+    const auto it = ids.find(id);
+    return it != ids.end() ? it->second.id : id;
+  };
+
+  auto same = expected.entity_locations.size() == actual.entity_locations.size();
+  for (const auto &[expected_entity, location] : expected.entity_locations) {
+    auto a = ruecs::Entity{expected_entity.id, &expected};
+    auto b = ruecs::Entity{actual_id(expected_entity.id), &actual};
+    const auto it = actual.entity_locations.find(b);
+    if (it == actual.entity_locations.end()) {
+      return false;
+    }
+
+    same = same && std::ranges::equal(location.arch->component_ids, it->second.arch->component_ids);
+    same = same && same_component<Position>(a, b) && same_component<Counter>(a, b) && same_component<Name>(a, b) &&
+           same_component<Buff>(a, b);
+    same = same && (a.try_get<Position>() == nullptr || a.is_enabled<Position>() == b.is_enabled<Position>());
+
+    const auto material = a.get_shared<Material>();
+    same = same && (material == nullptr ? b.get_shared<Material>() == nullptr : *material == *b.get_shared<Material>());
+    const auto parent = a.get_shared<ruecs::ChildOf>();
+    same = same && (parent == nullptr ? b.get_shared<ruecs::ChildOf>() == nullptr
+                                      : actual_id(parent->target) == b.get_shared<ruecs::ChildOf>()->target);
+  }
+  return same;
+}
+
+auto test_snapshot() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  populate(world, 3000);
+
+  for (const auto compress : {false, true}) {
+    auto out = std::stringstream{};
+    world.save(out, compress);
+    const auto bytes = out.str();
+
+    auto loaded = ruecs::ArchetypeStorage{};
+    auto in = std::istringstream{bytes};
+    CHECK(loaded.load(in));
+    CHECK(same_entities(world, loaded));
+  }
+
+  // a cut short snapshot fails and leaves the storage as it was
+  auto small = ruecs::ArchetypeStorage{};
+  populate(small, 100);
+  for (const auto compress : {false, true}) {
+    auto out = std::stringstream{};
+    small.save(out, compress);
+    const auto bytes = out.str();
+
+    auto kept = ruecs::ArchetypeStorage{};
+    auto sentinel = kept.create_entity(Position{-1, -1, -1});
+    for (auto size = std::size_t{}; size < bytes.size(); size += size < 512 ? 1 : 13) {
+      auto truncated = std::istringstream{bytes.substr(0, size)};
+      CHECK(not kept.load(truncated));
+      auto partition = std::istringstream{bytes.substr(0, size)};
+      CHECK(not kept.load_partition(partition));
+    }
+    CHECK(kept.entity_locations.size() == 1);
+    CHECK(*sentinel.get_component<Position>() == Position{-1, -1, -1});
+  }
+}
+
+// swap-removes that cross a 64-row boundary keep one enabled bit per row in the file
+auto test_snapshot_after_swap_remove() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  auto entities = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 65; ++i) {
+    entities.push_back(world.create_entity(Position{static_cast<float>(i), 0, 0}));
+  }
+  entities.front().set_enabled<Position>(false);
+  world.delete_entity(entities.back());
+  entities.pop_back();
+  world.delete_entity(entities[1]);
+
+  for (const auto compress : {false, true}) {
+    auto out = std::stringstream{};
+    world.save(out, compress);
+
+    auto loaded = ruecs::ArchetypeStorage{};
+    CHECK(loaded.load(out));
+    CHECK(same_entities(world, loaded));
+    for (auto i = 2; i < 64; ++i) {
+      CHECK(*ruecs::Entity{entities[i].id, &loaded}.get_component<Position>() ==
+            Position{static_cast<float>(i), 0, 0});
+    }
+  }
+}
+
+auto test_mapped_snapshot() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  populate(world, 20000);
+
+  const auto path = std::filesystem::temp_directory_path() / "rubus-ecs-snapshot-test.snapshot";
+  {
+    auto out = std::ofstream{path, std::ios::binary | std::ios::trunc};
+    world.save(out);
+  }
+
+  auto mapped = ruecs::ArchetypeStorage{};
+  CHECK(mapped.map_snapshot(path));
+  CHECK(same_entities(world, mapped));
+
+  // the storage keeps the mapping it has if a truncated file fails
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+  CHECK(not mapped.map_snapshot(path));
+  CHECK(same_entities(world, mapped));
+  std::filesystem::remove(path);
+}
+
+auto test_partition() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  populate(world, 1000);
+
+  auto query = ruecs::Query{&world}.with<Material>();
+  auto out = std::stringstream{};
+  world.save_partition(query, out, true);
+
+  // a copy with its archetypes at other addresses writes the same bytes
+  auto copy = world.clone();
+  auto copy_query = ruecs::Query{copy.get()}.with<Material>();
+  auto copy_out = std::stringstream{};
+  copy->save_partition(copy_query, copy_out, true);
+  CHECK(copy_out.str() == out.str());
+
+  // every entity of the partition comes back with a new id, and pairs point at the new ids
+  auto part = ruecs::ArchetypeStorage{};
+  {
+    auto copy = std::istringstream{out.str()};
+    CHECK(part.load(copy));
+  }
+  auto ids = std::unordered_map<ruecs::EntityId, ruecs::Entity>{};
+  auto in = std::istringstream{out.str()};
+  auto streamed = ruecs::ArchetypeStorage{};
+  CHECK(streamed.load_partition(in, &ids));
+  CHECK(ids.size() == part.entity_locations.size());
+  CHECK(same_entities(part, streamed, ids));
+}
+
+auto test_delta() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  auto entities = populate(world, 300);
+
+  auto base = std::stringstream{};
+  world.save(base);
+  const auto prev = world.snapshot();
+
+  // changed components, archetype changes, shared values, sparse components, created and deleted entities
+  for (auto i = std::size_t{}; i < entities.size(); i += 3) {
+    entities[i].get_component<Position>()->y += 1;
+  }
+  for (auto i = std::size_t{1}; i < entities.size(); i += 11) {
+    entities[i].add_component<Frozen>();
+    entities[i].add_component<Material>(Material{42});
+  }
+  for (auto i = std::size_t{}; i < entities.size(); i += 10) {
+    entities[i].remove_component<Buff>();
+  }
+  for (auto i = std::size_t{2}; i < entities.size(); i += 13) {
+    entities[i].add_component<Buff>(Buff{1.5f});
+  }
+  for (auto i = std::size_t{5}; i < entities.size(); i += 17) {
+    world.delete_entity(entities[i]);
+  }
+  populate(world, 20);
+
+  auto out = std::stringstream{};
+  world.diff(prev, out);
+  const auto bytes = out.str();
+
+  auto replica = ruecs::ArchetypeStorage{};
+  {
+    auto in = std::istringstream{base.str()};
+    CHECK(replica.load(in));
+  }
+  auto in = std::istringstream{bytes};
+  CHECK(replica.apply_delta(in));
+  CHECK(same_entities(world, replica));
+
+  // a cut short delta is reported and leaves the storage as it was
+  auto original = ruecs::ArchetypeStorage{};
+  auto scratch = ruecs::ArchetypeStorage{};
+  for (auto storage : {&original, &scratch}) {
+    auto base_in = std::istringstream{base.str()};
+    CHECK(storage->load(base_in));
+  }
+  for (auto size = std::size_t{}; size < bytes.size(); size += size < 256 ? 1 : 7) {
+    auto truncated = std::istringstream{bytes.substr(0, size)};
+    CHECK(not scratch.apply_delta(truncated));
+    CHECK(same_entities(original, scratch));
+  }
+}
+
+auto test_async_writer() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  populate(world, 200);
+  auto owners = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 50; ++i) {
+    owners.push_back(world.create_entity(Position{}, Owned{std::make_unique<int32_t>(i)}));
+  }
+
+  // components that can't be copied are saved in the background like the others
+  const auto path = std::filesystem::temp_directory_path() / "rubus-ecs-snapshot-test.async";
+  auto writer = ruecs::AsyncSnapshotWriter{};
+  writer.start(world, path);
+  *owners.front().get_component<Owned>()->value = -1;
+  CHECK(writer.wait());
+
+  auto loaded = ruecs::ArchetypeStorage{};
+  auto in = std::ifstream{path, std::ios::binary};
+  CHECK(loaded.load(in));
+  CHECK(same_entities(world, loaded));
+  for (auto i = 0; i < 50; ++i) {
+    const auto owned = ruecs::Entity{owners[i].id, &loaded}.try_get<Owned>();
+    CHECK(owned != nullptr && *owned->value == i);
+  }
+  in.close();
+  std::filesystem::remove(path);
+}
+
+auto test_command_log() -> void {
+  const auto path = std::filesystem::temp_directory_path() / "rubus-ecs-snapshot-test.log";
+  std::filesystem::remove(path);
+
+  auto world = ruecs::ArchetypeStorage{};
+  auto entities = populate(world, 100);
+  auto base = std::stringstream{};
+  world.save(base);
+
+  constexpr auto batch_count = std::size_t{20};
+  {
+    auto log = ruecs::CommandLog{path};
+    CHECK(log.is_open());
+    world.command_log = &log;
+    for (auto batch = std::size_t{}; batch < batch_count; ++batch) {
+      auto command = ruecs::Command{&world};
+      auto created = command.create_entity();
+      created.add_component<Counter>(Counter{static_cast<int32_t>(batch), 1});
+      command.add_component<Name>(entities[batch], Name{"renamed in batch " + std::to_string(batch)});
+      command.remove_component<Counter>(entities[batch + batch_count]);
+      command.delete_entity(ruecs::ReadOnlyEntity{.command = nullptr,
+                                                  .arch_storage = &world,
+                                                  .arch = nullptr,
+                                                  .index = {},
+                                                  .id = entities[batch + 2 * batch_count].id});
+      CHECK(command.run());
+    }
+    world.command_log = nullptr;
+  }
+
+  const auto bytes = [&] {
+    auto in = std::ifstream{path, std::ios::binary};
+    return std::string{std::istreambuf_iterator<char>{in}, {}};
+  }();
+  std::filesystem::remove(path);
+
+  auto replica = ruecs::ArchetypeStorage{};
+  {
+    auto in = std::istringstream{base.str()};
+    CHECK(replica.load(in));
+  }
+  auto in = std::istringstream{bytes};
+  CHECK(replica.replay(in) == batch_count);
+  CHECK(same_entities(world, replica));
+
+  // a torn log replays the batches before the tear
+  auto previous = std::size_t{};
+  for (auto size = std::size_t{}; size < bytes.size(); size += 7) {
+    auto scratch = ruecs::ArchetypeStorage{};
+    auto base_in = std::istringstream{base.str()};
+    CHECK(scratch.load(base_in));
+    auto truncated = std::istringstream{bytes.substr(0, size)};
+    const auto batches = scratch.replay(truncated);
+    CHECK(batches < batch_count && batches >= previous);
+    previous = batches;
+  }
+}
+
+} // namespace
+
+auto main() -> int {
+  register_components();
+
+  test_snapshot();
+  test_snapshot_after_swap_remove();
+  test_mapped_snapshot();
+  test_partition();
+  test_delta();
+  test_async_writer();
+  test_command_log();
+
+  if (failures != 0) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,524 @@
+#include <rubus-ecs/ecs.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Behavior of the storage: reservation, enabled bits, sparse sets, compaction, clones, merges, instances,
+// shared values and bulk deletes.
+
+namespace {
+
+struct Position {
+  float x = 0;
+  float y = 0;
+
+  auto operator==(const Position &other) const -> bool = default;
+};
+
+struct Velocity {
+  float x = 0;
+  float y = 0;
+
+  auto operator==(const Velocity &other) const -> bool = default;
+};
+
+// columns move components with memcpy, names are kept longer than small strings so they live on the heap
+struct Name {
+  std::string value;
+};
+
+// can be moved but not copied
+struct Owned {
+  std::unique_ptr<int32_t> value;
+};
+
+struct Health {
+  int32_t value = 0;
+};
+
+struct Buff {
+  static constexpr auto sparse_storage = true;
+  float amount = 0;
+
+  auto operator==(const Buff &other) const -> bool = default;
+};
+
+struct Material {
+  static constexpr auto shared_storage = true;
+  int32_t id = 0;
+
+  auto operator==(const Material &other) const -> bool = default;
+};
+
+auto failures = 0;
+
+#define CHECK(...)                                                                                                     \
+  do {                                                                                                                 \
+    if (not(__VA_ARGS__)) {                                                                                            \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__);                                      \
+      failures += 1;                                                                                                   \
+    }                                                                                                                  \
+  } while (false)
+
+template <typename T>
+auto column_of(ruecs::ArchetypeStorage &arch_storage, ruecs::Entity entity) -> ruecs::ComponentArray * {
+  return arch_storage.entity_locations.at(entity).arch->find_column(ruecs::component_id<T>());
+}
+
+auto count_matches(ruecs::Query query) -> std::size_t {
+  auto command = ruecs::Command{query.arch_storage};
+  auto matched = std::size_t{};
+  for_each_entities(query.arch_storage, &command, query) {
+    matched += 1;
+  }
+  return matched;
+}
+
+auto test_enabled_bits() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto entities = std::vector<ruecs::Entity>{};
+  auto enabled = std::unordered_map<ruecs::Entity, bool>{};
+  for (auto i = 0; i < 200; ++i) {
+    auto entity = arch_storage.create_entity(Position{float(i), 0}, Velocity{});
+    entities.push_back(entity);
+    enabled[entity] = i % 3 != 0;
+    if (i % 3 == 0) {
+      entity.set_enabled<Position>(false);
+    }
+  }
+
+  const auto check_bits = [&] {
+    const auto column = column_of<Position>(arch_storage, entities.front());
+    auto disabled = std::size_t{};
+    for (auto entity : entities) {
+      CHECK(entity.is_enabled<Position>() == enabled.at(entity));
+      CHECK(entity.is_enabled<Velocity>());
+      disabled += enabled.at(entity) ? 0 : 1;
+    }
+    CHECK(column->count == entities.size());
+    CHECK(column->disabled_count == disabled);
+    CHECK(column->enabled_bits.size() == (disabled == 0 ? 0 : (column->count + 63) / 64));
+    if (column->count % 64 != 0 && not column->enabled_bits.empty()) {
+      CHECK(column->enabled_bits.back() >> (column->count % 64) == 0);
+    }
+
+    // queries including a disabled component skip the entity, the others don't
+    CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position>()) == entities.size() - disabled);
+    CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position, Velocity>()) == entities.size() - disabled);
+    CHECK(count_matches(ruecs::Query{&arch_storage}.with<Velocity>()) == entities.size());
+  };
+  check_bits();
+
+  // swap-removes move the last row's bit and shrink the bits across word boundaries
+  for (const auto i : {0, 5, 64, 63, 1, 100}) {
+    arch_storage.delete_entity(entities[i]);
+    enabled.erase(entities[i]);
+    entities.erase(entities.begin() + i);
+    check_bits();
+  }
+  while (entities.size() > 60) {
+    arch_storage.delete_entity(entities.back());
+    enabled.erase(entities.back());
+    entities.pop_back();
+    check_bits();
+  }
+
+  // rows appended after the deletes start enabled
+  for (auto i = 0; i < 80; ++i) {
+    auto entity = arch_storage.create_entity(Position{}, Velocity{});
+    entities.push_back(entity);
+    enabled[entity] = true;
+  }
+  check_bits();
+
+  // enabling every row drops the bits
+  for (auto entity : entities) {
+    entity.set_enabled<Position>(true);
+    enabled[entity] = true;
+  }
+  check_bits();
+}
+
+// bulk creation after `reserve` doesn't grow the columns or rehash the locations
+auto test_reserve() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  [[maybe_unused]] auto other = arch_storage.create_entity(Velocity{});
+  arch_storage.reserve<Position, Velocity>(1000);
+
+  const auto buckets = arch_storage.entity_locations.bucket_count();
+  auto first = arch_storage.create_entity(Position{}, Velocity{});
+  const auto data = column_of<Position>(arch_storage, first)->array.data();
+  for (auto i = 1; i < 1000; ++i) {
+    [[maybe_unused]] auto entity = arch_storage.create_entity(Position{float(i), 0}, Velocity{});
+  }
+  CHECK(arch_storage.entity_locations.bucket_count() == buckets);
+  CHECK(column_of<Position>(arch_storage, first)->array.data() == data);
+  CHECK(column_of<Position>(arch_storage, first)->count == 1000);
+}
+
+auto test_delete_all() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto moving = std::vector<ruecs::Entity>{};
+  auto still = std::vector<ruecs::Entity>{};
+  auto velocities = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 100; ++i) {
+    moving.push_back(arch_storage.create_entity(Position{}, Velocity{}));
+    still.push_back(arch_storage.create_entity(Position{}));
+    velocities.push_back(arch_storage.create_entity(Velocity{}));
+    if (i % 2 == 0) {
+      moving.back().add_component<Buff>(Buff{1});
+      velocities.back().add_component<Buff>(Buff{2});
+    }
+  }
+  const auto alive = [&](ruecs::Entity entity) {
+    return arch_storage.entity_locations.contains(entity);
+  };
+  auto &buffs = arch_storage.get_sparse_set<Buff>();
+
+  // whole tables are dropped, with the sparse components of their entities
+  ruecs::Query{&arch_storage}.with<Position, Velocity>().delete_all();
+  CHECK(std::ranges::none_of(moving, alive));
+  CHECK(std::ranges::all_of(still, alive) && std::ranges::all_of(velocities, alive));
+  CHECK(buffs.entities.size() == 50);
+  CHECK(std::ranges::none_of(moving, [&](ruecs::Entity entity) {
+    return buffs.contains(entity);
+  }));
+
+  // disabled rows don't match, so they survive
+  for (auto i = 0; i < 10; ++i) {
+    still[i].set_enabled<Position>(false);
+  }
+  ruecs::Query{&arch_storage}.with<Position>().delete_all();
+  CHECK(std::ranges::all_of(still.begin(), still.begin() + 10, alive));
+  CHECK(std::ranges::none_of(still.begin() + 10, still.end(), alive));
+
+  // sparse includes match part of a table
+  ruecs::Query{&arch_storage}.with<Velocity, Buff>().delete_all();
+  for (auto i = std::size_t{}; i < velocities.size(); ++i) {
+    CHECK(alive(velocities[i]) == (i % 2 != 0));
+  }
+  CHECK(buffs.entities.empty());
+
+  // deferred deletes wait for the command to run
+  auto command = ruecs::Command{&arch_storage};
+  auto query = ruecs::Query{&arch_storage}.with<Velocity>();
+  query.delete_all(&command);
+  CHECK(std::ranges::count_if(velocities, alive) == 50);
+  CHECK(command.run());
+  CHECK(std::ranges::none_of(velocities, alive));
+  CHECK(arch_storage.entity_locations.size() == 10);
+}
+
+auto test_compact() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto positions = std::vector<ruecs::Entity>{};
+  auto moving = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 1000; ++i) {
+    positions.push_back(arch_storage.create_entity(Position{float(i), 0}));
+  }
+  for (auto i = 0; i < 10; ++i) {
+    moving.push_back(arch_storage.create_entity(Position{}, Velocity{}));
+  }
+  auto query = ruecs::Query{&arch_storage}.with<Position>();
+  CHECK(count_matches(query) == 1010);
+
+  for (const auto entity : moving) {
+    arch_storage.delete_entity(entity);
+  }
+  while (positions.size() > 100) {
+    arch_storage.delete_entity(positions.back());
+    positions.pop_back();
+  }
+
+  // the empty archetype is erased and its id is free, queries made before drop it
+  const auto erased_id = arch_storage.archetypes.size() - 1;
+  const auto archetype_count = arch_storage.archetype_count;
+  const auto arch_version = arch_storage.arch_version;
+  arch_storage.compact();
+  CHECK(arch_storage.archetypes[erased_id] == nullptr);
+  CHECK(arch_storage.archetype_count == archetype_count - 1);
+  CHECK(arch_storage.arch_version != arch_version);
+  CHECK(not arch_storage.component_locations.contains(ruecs::component_id<Velocity>()));
+  CHECK(count_matches(query) == 100);
+
+  // oversized columns are shrunk and keep their rows
+  const auto arch = arch_storage.entity_locations.at(positions.front()).arch;
+  CHECK(arch->entities.capacity() < 1000);
+  for (auto i = std::size_t{}; i < positions.size(); ++i) {
+    CHECK(*positions[i].get_component<Position>() == Position{float(i), 0});
+  }
+
+  // the next new archetype takes the free id, the erased signature gets a new archetype
+  auto health = arch_storage.create_entity(Health{});
+  CHECK(arch_storage.entity_locations.at(health).arch->id.value == erased_id);
+  auto moved = arch_storage.create_entity(Position{1, 1}, Velocity{});
+  CHECK(arch_storage.entity_locations.at(moved).arch->id.value == erased_id + 1);
+  CHECK(count_matches(query) == 101);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Health>()) == 1);
+}
+
+auto test_sparse_components() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto entities = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 100; ++i) {
+    entities.push_back(arch_storage.create_entity(Position{float(i), 0}));
+  }
+
+  // adding and removing never moves the entity
+  const auto location = arch_storage.entity_locations.at(entities[10]);
+  for (auto i = 0; i < 100; i += 2) {
+    entities[i].add_component<Buff>(Buff{float(i)});
+  }
+  const auto moved = arch_storage.entity_locations.at(entities[10]);
+  CHECK(moved.arch == location.arch && moved.index.i == location.index.i);
+  CHECK(entities[10].get_component<Buff>()->amount == 10);
+  CHECK(entities[11].try_get<Buff>() == nullptr);
+
+  // queries include and exclude sparse components per entity
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position, Buff>()) == 50);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position>().without<Buff>()) == 50);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Buff>()) == 50);
+
+  // removing swaps the last component into the hole
+  entities[0].remove_component<Buff>();
+  CHECK(entities[0].try_get<Buff>() == nullptr);
+  CHECK(entities[98].get_component<Buff>()->amount == 98);
+
+  // disabled sparse components don't match
+  entities[2].set_enabled<Buff>(false);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Buff>()) == 48);
+
+  // deleting the entity deletes its sparse component
+  arch_storage.delete_entity(entities[4]);
+  auto &buffs = arch_storage.get_sparse_set<Buff>();
+  CHECK(not buffs.contains(entities[4]));
+  CHECK(buffs.entities.size() == 48);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position>()) == 99);
+}
+
+auto test_clone() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto entities = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 100; ++i) {
+    entities.push_back(arch_storage.create_entity(Position{float(i), 0}, Name{"entity with a long name " + std::to_string(i)}));
+    if (i % 3 == 0) {
+      entities.back().add_component<Buff>(Buff{float(i)});
+    }
+  }
+  entities[7].set_enabled<Position>(false);
+
+  auto copy = arch_storage.clone();
+  const auto in_copy = [&](ruecs::Entity entity) {
+    return ruecs::Entity{entity.id, copy.get()};
+  };
+  CHECK(copy->entity_locations.size() == arch_storage.entity_locations.size());
+
+  // memcpy-able columns are shared until one side writes, the others are copied
+  const auto column = column_of<Position>(arch_storage, entities[0]);
+  const auto copy_column = column_of<Position>(*copy, in_copy(entities[0]));
+  CHECK(column->array.is_shared() && copy_column->array.is_shared());
+  CHECK(std::as_const(column->array).data() == std::as_const(copy_column->array).data());
+  CHECK(not column_of<Name>(*copy, in_copy(entities[0]))->array.is_shared());
+
+  // writes on either side stay on that side
+  in_copy(entities[1]).get_component<Position>()->x = -1;
+  CHECK(not copy_column->array.is_shared());
+  CHECK(entities[1].get_component<Position>()->x == 1);
+  entities[2].get_component<Position>()->x = -2;
+  CHECK(in_copy(entities[2]).get_component<Position>()->x == 2);
+  in_copy(entities[3]).get_component<Name>()->value = "renamed entity with a long name";
+  CHECK(entities[3].get_component<Name>()->value == "entity with a long name 3");
+  in_copy(entities[3]).get_component<Buff>()->amount = -3;
+  CHECK(entities[3].get_component<Buff>()->amount == 3);
+
+  // enabled bits and sparse components are copied
+  CHECK(not in_copy(entities[7]).is_enabled<Position>());
+  CHECK(count_matches(ruecs::Query{copy.get()}.with<Buff>()) == 34);
+
+  // a component that can't be copied refuses the clone before anything is copied
+  auto owner = arch_storage.create_entity(Owned{std::make_unique<int32_t>(1)});
+  auto threw = false;
+  try {
+    [[maybe_unused]] auto refused = arch_storage.clone();
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+
+  // unless it is given a way to copy it
+  auto copied = arch_storage.clone(nullptr, true, [](ruecs::ComponentId id, void *dst, const void *src) {
+    CHECK(id == ruecs::component_id<Owned>());
+    const auto &owned = *static_cast<const Owned *>(src);
+    std::construct_at(static_cast<Owned *>(dst), Owned{std::make_unique<int32_t>(*owned.value)});
+  });
+  CHECK(*ruecs::Entity{owner.id, copied.get()}.get_component<Owned>()->value == 1);
+}
+
+auto test_merge() -> void {
+  auto world = ruecs::ArchetypeStorage{};
+  auto existing = world.create_entity(Position{-1, -1});
+
+  auto staging = ruecs::ArchetypeStorage{};
+  auto staged = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 100; ++i) {
+    staged.push_back(staging.create_entity(Position{float(i), 0}, Velocity{float(i), 1}));
+    if (i % 4 == 0) {
+      staged.back().add_component<Buff>(Buff{float(i)});
+      staged.back().set_enabled<Velocity>(false);
+    }
+  }
+
+  // entities keep their ids, whole columns move and `staging` is left empty
+  world.merge(std::move(staging));
+  CHECK(staging.entity_locations.empty());
+  CHECK(world.entity_locations.size() == 101);
+  CHECK(*existing.get_component<Position>() == Position{-1, -1});
+  for (auto i = std::size_t{}; i < staged.size(); ++i) {
+    auto entity = ruecs::Entity{staged[i].id, &world};
+    CHECK(*entity.get_component<Position>() == Position{float(i), 0});
+    CHECK(*entity.get_component<Velocity>() == Velocity{float(i), 1});
+    CHECK(entity.is_enabled<Velocity>() == (i % 4 != 0));
+    const auto buff = entity.try_get<Buff>();
+    CHECK(i % 4 == 0 ? buff != nullptr && buff->amount == float(i) : buff == nullptr);
+  }
+  CHECK(count_matches(ruecs::Query{&world}.with<Position, Velocity>()) == 75);
+
+  // ids the storage already has get new ones, like those of a clone, `new_ids` renumbers every entity
+  auto twin = ruecs::ArchetypeStorage{};
+  twin.merge(std::move(*world.clone()));
+  auto fresh = twin.create_entity(Position{2, 2});
+  auto remapped = std::unordered_map<ruecs::EntityId, ruecs::Entity>{};
+  world.merge(std::move(twin), &remapped);
+  CHECK(remapped.size() == 101 && not remapped.contains(fresh.id));
+  CHECK(*remapped.at(existing.id).get_component<Position>() == Position{-1, -1});
+  CHECK(*ruecs::Entity{fresh.id, &world}.get_component<Position>() == Position{2, 2});
+  CHECK(world.entity_locations.size() == 203);
+
+  auto renumbered = ruecs::ArchetypeStorage{};
+  auto renumbered_entity = renumbered.create_entity(Position{3, 3});
+  world.merge(std::move(renumbered), &remapped, true);
+  CHECK(remapped.size() == 1);
+  CHECK(*remapped.at(renumbered_entity.id).get_component<Position>() == Position{3, 3});
+}
+
+auto test_instantiate() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto others = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 50; ++i) {
+    others.push_back(arch_storage.create_entity(Position{float(i), 0}, Name{"an entity that isn't a prefab"},
+                                                Health{i}));
+  }
+  auto prefab = arch_storage.create_entity(Position{1, 2}, Name{"a prefab with a name on the heap"}, Health{100});
+  prefab.add_component<Buff>(Buff{5});
+  prefab.set_enabled<Position>(false);
+
+  // copies of every component, enabled bit and sparse component, appended across several bit words
+  auto instances = arch_storage.instantiate(prefab, 130);
+  CHECK(instances.size() == 130);
+  CHECK(arch_storage.entity_locations.size() == 181);
+  for (auto instance : instances) {
+    CHECK(arch_storage.entity_locations.at(instance).arch == arch_storage.entity_locations.at(prefab).arch);
+    CHECK(*instance.get_component<Position>() == Position{1, 2});
+    CHECK(instance.get_component<Name>()->value == "a prefab with a name on the heap");
+    CHECK(instance.get_component<Health>()->value == 100);
+    CHECK(instance.get_component<Buff>()->amount == 5);
+    CHECK(not instance.is_enabled<Position>());
+  }
+  CHECK(column_of<Position>(arch_storage, prefab)->disabled_count == 131);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Position>()) == 50);
+  CHECK(count_matches(ruecs::Query{&arch_storage}.with<Buff>()) == 131);
+
+  // the instances don't share anything with the prefab or each other
+  instances[0].get_component<Name>()->value = "an instance renamed on its own";
+  instances[1].get_component<Buff>()->amount = 6;
+  CHECK(prefab.get_component<Name>()->value == "a prefab with a name on the heap");
+  CHECK(instances[2].get_component<Name>()->value == "a prefab with a name on the heap");
+  CHECK(prefab.get_component<Buff>()->amount == 5);
+  CHECK(others[49].get_component<Name>()->value == "an entity that isn't a prefab");
+
+  // a prefab that can't be copied creates nothing
+  auto owner = arch_storage.create_entity(Owned{std::make_unique<int32_t>(1)});
+  auto threw = false;
+  try {
+    [[maybe_unused]] auto refused = arch_storage.instantiate(owner, 10);
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(arch_storage.entity_locations.size() == 182);
+}
+
+auto test_shared_values() -> void {
+  auto arch_storage = ruecs::ArchetypeStorage{};
+  auto entities = std::vector<ruecs::Entity>{};
+  for (auto i = 0; i < 99; ++i) {
+    entities.push_back(arch_storage.create_entity(Position{float(i), 0}, Material{i % 3}));
+  }
+  const auto &materials = arch_storage.shared_value_sets.at(ruecs::component_id<Material>());
+  const auto arch_of = [&](ruecs::Entity entity) {
+    return arch_storage.entity_locations.at(entity).arch;
+  };
+
+  // equal values are stored once and pick the archetype
+  CHECK(materials.values.size() == 3);
+  CHECK(arch_of(entities[0]) == arch_of(entities[3]) && arch_of(entities[0]) != arch_of(entities[1]));
+  CHECK(entities[3].get_shared<Material>() == entities[0].get_shared<Material>());
+  CHECK(entities[4].get_shared<Material>()->id == 1);
+  CHECK(arch_of(arch_storage.create_entity(Position{99, 0}, Material{0})) == arch_of(entities[0]));
+
+  // queries read the value once per archetype
+  auto query = ruecs::Query{&arch_storage}.with<Position, Material>();
+  auto command = ruecs::Command{&arch_storage};
+  auto matched = std::size_t{};
+  for_each_entities(&arch_storage, &command, query) {
+    CHECK(query.get_shared<Material>()->id == int32_t(entity.get_component<Position>()->x) % 3);
+    matched += 1;
+  }
+  CHECK(matched == 100);
+
+  // adding another value moves the entity, removing it moves it out
+  entities[0].add_component<Material>(Material{7});
+  CHECK(entities[0].get_shared<Material>()->id == 7);
+  CHECK(*entities[0].get_component<Position>() == Position{0, 0});
+  CHECK(materials.values.size() == 4);
+  entities[1].remove_component<Material>();
+  CHECK(entities[1].get_shared<Material>() == nullptr);
+  CHECK(*entities[1].get_component<Position>() == Position{1, 0});
+
+  // a value is freed once compact erases the last archetype using it
+  for (auto i = std::size_t{2}; i < entities.size(); i += 3) {
+    arch_storage.delete_entity(entities[i]);
+  }
+  CHECK(materials.values.size() == 4);
+  arch_storage.compact();
+  CHECK(materials.values.size() == 3);
+  CHECK(entities[3].get_shared<Material>()->id == 0);
+  CHECK(entities[4].get_shared<Material>()->id == 1);
+}
+
+} // namespace
+
+auto main() -> int {
+  test_enabled_bits();
+  test_reserve();
+  test_delete_all();
+  test_compact();
+  test_sparse_components();
+  test_clone();
+  test_merge();
+  test_instantiate();
+  test_shared_values();
+
+  if (failures != 0) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}